@@ -5,79 +5,289 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
 
+#include "example.h"
+
 // Constants and macros
-#define MAX_USERS 100
+#define REPOSITORY_MIN_CAPACITY 8
+#define DEFAULT_COMPACT_PERCENT 25
 #define MAX_NAME_LEN 50
 #define MAX_EMAIL_LEN 100
+#define MAX_AGE 150
+#define ADULT_AGE 18
+#define WRITER_BUFFER_SIZE 65536
+
+// Longest line user_format can produce, including the terminator
+#define USER_FORMAT_MAX (34 + MAX_NAME_LEN + MAX_EMAIL_LEN + 24)
+#define ARENA_SLAB_USERS 256
+#define STRING_GRANULE 16
+#define STRING_CLASSES ((MAX_EMAIL_LEN + STRING_GRANULE - 1) / STRING_GRANULE)
+#define STRING_SLAB_GRANULES 4096
 #define API_VERSION "v1.0"
 
 // Type definitions
+
+// Names and emails are exact-size copies, cut to MAX_NAME_LEN - 1 and
+// MAX_EMAIL_LEN - 1 characters: behind the struct for heap users, in
+// the repository's StringPool for arena users
 typedef struct User {
     int id;
-    char name[MAX_NAME_LEN];
-    char email[MAX_EMAIL_LEN];
     int age;
     time_t created_at;
+    const char* name;
+    const char* email;
+    unsigned char name_len;
+    unsigned char email_len;
+    bool in_arena;
 } User;
 
+// Arena slot: holds a live user or links to the next free slot
+typedef union UserSlot {
+    User user;
+    union UserSlot* next_free;
+} UserSlot;
+
+typedef struct UserSlab {
+    struct UserSlab* next;
+    int used;
+    UserSlot slots[ARENA_SLAB_USERS];
+} UserSlab;
+
+typedef struct UserArena {
+    UserSlab* slabs;
+    UserSlot* free_list;
+} UserArena;
+
+// Strings of arena users, NUL-terminated, in 16-byte granules carved
+// from slabs. A released string goes on the free list for its granule
+// count, and the next string needing that many granules reuses it.
+typedef union StringGranule {
+    union StringGranule* next_free;
+    char text[STRING_GRANULE];
+} StringGranule;
+
+typedef struct StringSlab {
+    struct StringSlab* next;
+    int used;
+    StringGranule granules[STRING_SLAB_GRANULES];
+} StringSlab;
+
+typedef struct StringPool {
+    StringSlab* slabs;
+    StringGranule* free_lists[STRING_CLASSES];
+} StringPool;
+
+// Running age aggregates, updated on every add, remove and age change
+typedef struct AgeStats {
+    long long sum;
+    int adults;
+    int histogram[MAX_AGE + 1];
+    int min_age;
+    int max_age;
+    bool range_dirty;  // min/max need a rebuild from the histogram
+} AgeStats;
+
+// How repository_remove fills the hole left by a removed user
+typedef enum RemoveMode {
+    REMOVE_TOMBSTONE,  // keep order; holes are compacted in batches
+    REMOVE_SWAP,       // move the last user into the hole
+} RemoveMode;
+
 typedef struct UserRepository {
-    User* users[MAX_USERS];
-    int count;
+    User** users;
+    int count;         // live users
+    int length;        // used slots in users, including tombstones
+    int capacity;
+    int tombstones;
+    RemoveMode remove_mode;
+    int compact_percent;  // compact once tombstones reach this share
     int next_id;
+    int* slot_of_id;  // id -> index in users + 1, 0 when absent
+    int id_capacity;
+    int heap_users;
+    UserArena arena;
+    StringPool strings;
+    AgeStats ages;
 } UserRepository;
 
-// Function prototypes
-User* user_create(const char* name, const char* email, int age);
-void user_destroy(User* user);
-bool user_is_adult(const User* user);
-void user_print(const User* user);
+// Collects formatted users and writes them out in large blocks
+typedef struct UserWriter {
+    FILE* out;
+    size_t used;
+    char buffer[WRITER_BUFFER_SIZE];
+} UserWriter;
+
+// Function prototypes beyond the shared ones in example.h
+void writer_init(UserWriter* writer, FILE* out);
+void writer_write(UserWriter* writer, const char* prefix, const User* user);
+void writer_flush(UserWriter* writer);
+
+void repository_set_remove_mode(UserRepository* repo, RemoveMode mode,
+                                int compact_percent);
+void repository_compact(UserRepository* repo);
 
-UserRepository* repository_create(void);
-void repository_destroy(UserRepository* repo);
-bool repository_add(UserRepository* repo, User* user);
-User* repository_find_by_id(const UserRepository* repo, int id);
-User** repository_find_all(const UserRepository* repo, int* count);
-bool repository_remove(UserRepository* repo, int id);
+// Creation clock. Between user_clock_hold() and user_clock_release()
+// every user created on this thread shares one time() reading, so a bulk
+// import pays for a single clock read; holds nest.
+static _Thread_local int clock_holds = 0;
+static _Thread_local time_t clock_held_at;
+
+void user_clock_hold(void) {
+    if (clock_holds++ == 0) {
+        clock_held_at = time(NULL);
+    }
+}
+
+void user_clock_release(void) {
+    if (clock_holds > 0) {
+        clock_holds--;
+    }
+}
+
+static time_t user_clock_now(void) {
+    return clock_holds > 0 ? clock_held_at : time(NULL);
+}
 
 // User functions implementation
-User* user_create(const char* name, const char* email, int age) {
+static bool user_validate(const char* name, const char* email, int age) {
     if (name == NULL || email == NULL) {
         fprintf(stderr, "Error: name and email cannot be NULL\n");
-        return NULL;
+        return false;
     }
 
-    if (age < 0 || age > 150) {
+    if (age < 0 || age > MAX_AGE) {
         fprintf(stderr, "Error: invalid age %d\n", age);
+        return false;
+    }
+
+    return true;
+}
+
+// Length of `text` cut to at most `max_len` characters
+static size_t text_length(const char* text, size_t max_len) {
+    size_t length = 0;
+    while (length < max_len && text[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+static char* text_copy(char* dest, const char* text, size_t length) {
+    memcpy(dest, text, length);
+    dest[length] = '\0';
+    return dest;
+}
+
+// Fills a validated user whose strings are already in place
+static void user_init(User* user, const char* name, size_t name_len,
+                      const char* email, size_t email_len, int age) {
+    user->id = 0;
+    user->age = age;
+    user->created_at = user_clock_now();
+    user->name = name;
+    user->email = email;
+    user->name_len = (unsigned char)name_len;
+    user->email_len = (unsigned char)email_len;
+    user->in_arena = false;
+}
+
+// One allocation holds the user followed by its two strings
+User* user_create(const char* name, const char* email, int age) {
+    if (!user_validate(name, email, age)) {
         return NULL;
     }
 
-    User* user = (User*)malloc(sizeof(User));
+    size_t name_len = text_length(name, MAX_NAME_LEN - 1);
+    size_t email_len = text_length(email, MAX_EMAIL_LEN - 1);
+    User* user = (User*)malloc(sizeof(User) + name_len + email_len + 2);
     if (user == NULL) {
         fprintf(stderr, "Error: memory allocation failed\n");
         return NULL;
     }
 
-    user->id = 0;
-    strncpy(user->name, name, MAX_NAME_LEN - 1);
-    user->name[MAX_NAME_LEN - 1] = '\0';
-    strncpy(user->email, email, MAX_EMAIL_LEN - 1);
-    user->email[MAX_EMAIL_LEN - 1] = '\0';
-    user->age = age;
-    user->created_at = time(NULL);
-
+    char* text = (char*)(user + 1);
+    user_init(user, text_copy(text, name, name_len), name_len,
+              text_copy(text + name_len + 1, email, email_len), email_len,
+              age);
     return user;
 }
 
+// Arena-owned users are released with their repository, not here
 void user_destroy(User* user) {
-    if (user != NULL) {
+    if (user != NULL && !user->in_arena) {
         free(user);
     }
 }
 
 bool user_is_adult(const User* user) {
-    return user != NULL && user->age >= 18;
+    return user != NULL && user->age >= ADULT_AGE;
+}
+
+// Writes the decimal digits of `value` to `out`; returns the length
+static size_t format_int(char* out, int value) {
+    char digits[12];
+    size_t n = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value
+                                       : (unsigned int)value;
+    do {
+        digits[n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    size_t length = 0;
+    if (value < 0) {
+        out[length++] = '-';
+    }
+    while (n > 0) {
+        out[length++] = digits[--n];
+    }
+    return length;
+}
+
+// Like snprintf: returns the full length and writes (with a terminator)
+// only when it fits, but never touches printf or the heap. A NULL user
+// formats as an empty string, as in the C++ build.
+size_t user_format(char* buf, size_t cap, const User* user) {
+    if (user == NULL) {
+        if (cap > 0) {
+            buf[0] = '\0';
+        }
+        return 0;
+    }
+
+    char id[12];
+    char age[12];
+    size_t id_len = format_int(id, user->id);
+    size_t age_len = format_int(age, user->age);
+
+    const char* parts[] = {"User{id=", id, ", name=\"", user->name,
+                           "\", email=\"", user->email, "\", age=", age, "}"};
+    size_t lengths[] = {8, id_len, 8, user->name_len,
+                        10, user->email_len, 7, age_len, 1};
+
+    size_t length = 0;
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        length += lengths[i];
+    }
+
+    if (length >= cap) {
+        if (cap > 0) {
+            buf[0] = '\0';
+        }
+        return length;
+    }
+
+    char* out = buf;
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        memcpy(out, parts[i], lengths[i]);
+        out += lengths[i];
+    }
+    *out = '\0';
+    return length;
 }
 
 void user_print(const User* user) {
@@ -86,8 +296,181 @@ void user_print(const User* user) {
         return;
     }
 
-    printf("User{id=%d, name=\"%s\", email=\"%s\", age=%d}\n",
-           user->id, user->name, user->email, user->age);
+    char line[USER_FORMAT_MAX + 1];
+    size_t length = user_format(line, sizeof(line) - 1, user);
+    line[length++] = '\n';
+    fwrite(line, 1, length, stdout);
+}
+
+// Writer functions implementation
+void writer_init(UserWriter* writer, FILE* out) {
+    writer->out = out;
+    writer->used = 0;
+}
+
+void writer_flush(UserWriter* writer) {
+    if (writer->used > 0) {
+        fwrite(writer->buffer, 1, writer->used, writer->out);
+        writer->used = 0;
+    }
+}
+
+// Appends `prefix`, the formatted user and a newline
+void writer_write(UserWriter* writer, const char* prefix, const User* user) {
+    size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+    if (writer->used + prefix_len + USER_FORMAT_MAX + 1 > WRITER_BUFFER_SIZE) {
+        writer_flush(writer);
+    }
+
+    if (prefix_len > 0) {
+        memcpy(writer->buffer + writer->used, prefix, prefix_len);
+        writer->used += prefix_len;
+    }
+    writer->used += user_format(writer->buffer + writer->used,
+                                WRITER_BUFFER_SIZE - writer->used, user);
+    writer->buffer[writer->used++] = '\n';
+}
+
+// Arena functions implementation
+static void arena_init(UserArena* arena) {
+    arena->slabs = NULL;
+    arena->free_list = NULL;
+}
+
+static User* arena_alloc(UserArena* arena) {
+    if (arena->free_list != NULL) {
+        UserSlot* slot = arena->free_list;
+        arena->free_list = slot->next_free;
+        return &slot->user;
+    }
+
+    if (arena->slabs == NULL || arena->slabs->used == ARENA_SLAB_USERS) {
+        UserSlab* slab = (UserSlab*)malloc(sizeof(UserSlab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = arena->slabs;
+        slab->used = 0;
+        arena->slabs = slab;
+    }
+
+    return &arena->slabs->slots[arena->slabs->used++].user;
+}
+
+static void arena_release(UserArena* arena, User* user) {
+    UserSlot* slot = (UserSlot*)user;
+    slot->next_free = arena->free_list;
+    arena->free_list = slot;
+}
+
+// Frees whole slabs; no per-user work
+static void arena_destroy(UserArena* arena) {
+    UserSlab* slab = arena->slabs;
+    while (slab != NULL) {
+        UserSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    arena_init(arena);
+}
+
+// String pool functions implementation
+static void string_pool_init(StringPool* pool) {
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Granules for a string of `length` plus its terminator
+static int string_granules(size_t length) {
+    return (int)((length + STRING_GRANULE) / STRING_GRANULE);
+}
+
+// Room for `length` characters and a terminator
+static char* string_pool_alloc(StringPool* pool, size_t length) {
+    int granules = string_granules(length);
+    StringGranule* block = pool->free_lists[granules - 1];
+    if (block != NULL) {
+        pool->free_lists[granules - 1] = block->next_free;
+        return block->text;
+    }
+
+    StringSlab* slab = pool->slabs;
+    if (slab == NULL || slab->used + granules > STRING_SLAB_GRANULES) {
+        slab = (StringSlab*)malloc(sizeof(StringSlab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        slab->used = 0;
+        pool->slabs = slab;
+    }
+
+    block = &slab->granules[slab->used];
+    slab->used += granules;
+    return block->text;
+}
+
+static void string_pool_release(StringPool* pool, const char* text,
+                                size_t length) {
+    if (text == NULL) {
+        return;
+    }
+    int granules = string_granules(length);
+    StringGranule* block = (StringGranule*)(void*)text;
+    block->next_free = pool->free_lists[granules - 1];
+    pool->free_lists[granules - 1] = block;
+}
+
+static void string_pool_destroy(StringPool* pool) {
+    StringSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        StringSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    string_pool_init(pool);
+}
+
+// Age statistics implementation
+static void age_stats_init(AgeStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->min_age = MAX_AGE + 1;
+    stats->max_age = -1;
+}
+
+static void age_stats_add(AgeStats* stats, int age) {
+    stats->sum += age;
+    stats->adults += age >= ADULT_AGE;
+    stats->histogram[age]++;
+    if (!stats->range_dirty) {
+        if (age < stats->min_age) stats->min_age = age;
+        if (age > stats->max_age) stats->max_age = age;
+    }
+}
+
+static void age_stats_remove(AgeStats* stats, int age) {
+    stats->sum -= age;
+    stats->adults -= age >= ADULT_AGE;
+    stats->histogram[age]--;
+    if (age == stats->min_age || age == stats->max_age) {
+        stats->range_dirty = true;
+    }
+}
+
+// Rebuilding walks the fixed-size histogram, not the users
+static void age_stats_refresh(AgeStats* stats) {
+    if (!stats->range_dirty) {
+        return;
+    }
+
+    stats->min_age = MAX_AGE + 1;
+    stats->max_age = -1;
+    for (int age = 0; age <= MAX_AGE; age++) {
+        if (stats->histogram[age] > 0) {
+            if (stats->min_age > MAX_AGE) stats->min_age = age;
+            stats->max_age = age;
+        }
+    }
+    stats->range_dirty = false;
 }
 
 // Repository functions implementation
@@ -97,65 +480,331 @@ UserRepository* repository_create(void) {
         return NULL;
     }
 
+    repo->users = NULL;
     repo->count = 0;
+    repo->length = 0;
+    repo->capacity = 0;
+    repo->tombstones = 0;
+    repo->remove_mode = REMOVE_TOMBSTONE;
+    repo->compact_percent = DEFAULT_COMPACT_PERCENT;
     repo->next_id = 1;
-    for (int i = 0; i < MAX_USERS; i++) {
-        repo->users[i] = NULL;
-    }
+    repo->slot_of_id = NULL;
+    repo->id_capacity = 0;
+    repo->heap_users = 0;
+    arena_init(&repo->arena);
+    string_pool_init(&repo->strings);
+    age_stats_init(&repo->ages);
 
     return repo;
 }
 
+// Grow the user array to hold at least `capacity` entries
+bool repository_reserve(UserRepository* repo, int capacity) {
+    if (repo == NULL || capacity < 0) {
+        return false;
+    }
+
+    if (capacity <= repo->capacity) {
+        return true;
+    }
+
+    User** users = (User**)realloc(repo->users, capacity * sizeof(User*));
+    if (users == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        return false;
+    }
+
+    repo->users = users;
+    repo->capacity = capacity;
+    return true;
+}
+
+void repository_shrink_to_fit(UserRepository* repo) {
+    if (repo == NULL) {
+        return;
+    }
+
+    repository_compact(repo);
+    if (repo->count == repo->capacity) {
+        return;
+    }
+
+    if (repo->count == 0) {
+        free(repo->users);
+        repo->users = NULL;
+        repo->capacity = 0;
+        return;
+    }
+
+    User** users = (User**)realloc(repo->users, repo->count * sizeof(User*));
+    if (users != NULL) {
+        repo->users = users;
+        repo->capacity = repo->count;
+    }
+}
+
 void repository_destroy(UserRepository* repo) {
     if (repo == NULL) {
         return;
     }
 
-    for (int i = 0; i < repo->count; i++) {
-        if (repo->users[i] != NULL) {
+    // Only users created outside the arena need individual frees
+    for (int i = 0; i < repo->length && repo->heap_users > 0; i++) {
+        if (repo->users[i] != NULL && !repo->users[i]->in_arena) {
             user_destroy(repo->users[i]);
+            repo->heap_users--;
         }
     }
 
+    arena_destroy(&repo->arena);
+    string_pool_destroy(&repo->strings);
+    free(repo->users);
+    free(repo->slot_of_id);
     free(repo);
 }
 
+// Make sure `id` has an entry in the id index
+static bool repository_index_reserve(UserRepository* repo, int id) {
+    if (id < repo->id_capacity) {
+        return true;
+    }
+
+    // Ids stop below INT_MAX, so `id + 1` entries always fit in an int
+    int capacity = repo->id_capacity > INT_MAX / 2 ? INT_MAX
+                                                   : repo->id_capacity * 2;
+    if (capacity <= id) {
+        capacity = id < INT_MAX - REPOSITORY_MIN_CAPACITY
+                       ? id + REPOSITORY_MIN_CAPACITY
+                       : INT_MAX;
+    }
+
+    int* index = (int*)realloc(repo->slot_of_id, capacity * sizeof(int));
+    if (index == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        return false;
+    }
+
+    memset(index + repo->id_capacity, 0,
+           (capacity - repo->id_capacity) * sizeof(int));
+    repo->slot_of_id = index;
+    repo->id_capacity = capacity;
+    return true;
+}
+
+static int repository_slot_of(const UserRepository* repo, int id) {
+    if (id <= 0 || id >= repo->id_capacity) {
+        return -1;
+    }
+    return repo->slot_of_id[id] - 1;
+}
+
 bool repository_add(UserRepository* repo, User* user) {
     if (repo == NULL || user == NULL) {
         return false;
     }
 
-    if (repo->count >= MAX_USERS) {
+    if (repo->next_id == INT_MAX || repo->length == INT_MAX) {
         fprintf(stderr, "Error: repository is full\n");
         return false;
     }
 
+    if (!repository_index_reserve(repo, repo->next_id)) {
+        return false;
+    }
+
+    // Geometric growth keeps repeated adds amortized O(1); past INT_MAX / 2
+    // doubling would overflow, so the last step goes to INT_MAX
+    if (repo->length == repo->capacity) {
+        int capacity = repo->capacity > INT_MAX / 2 ? INT_MAX
+                                                    : repo->capacity * 2;
+        if (capacity < REPOSITORY_MIN_CAPACITY) {
+            capacity = REPOSITORY_MIN_CAPACITY;
+        }
+        if (!repository_reserve(repo, capacity)) {
+            return false;
+        }
+    }
+
     user->id = repo->next_id++;
-    repo->users[repo->count++] = user;
+    repo->users[repo->length++] = user;
+    repo->slot_of_id[user->id] = repo->length;
+    repo->count++;
+    age_stats_add(&repo->ages, user->age);
+    if (!user->in_arena) {
+        repo->heap_users++;
+    }
     return true;
 }
 
-User* repository_find_by_id(const UserRepository* repo, int id) {
-    if (repo == NULL) {
+// Hands an arena user's slot and strings back to the repository
+static void repository_release_arena_user(UserRepository* repo, User* user) {
+    string_pool_release(&repo->strings, user->name, user->name_len);
+    string_pool_release(&repo->strings, user->email, user->email_len);
+    arena_release(&repo->arena, user);
+}
+
+User* user_create_in(UserRepository* repo, const char* name,
+                     const char* email, int age) {
+    if (repo == NULL || !user_validate(name, email, age)) {
         return NULL;
     }
 
-    for (int i = 0; i < repo->count; i++) {
-        if (repo->users[i]->id == id) {
-            return repo->users[i];
+    size_t name_len = text_length(name, MAX_NAME_LEN - 1);
+    size_t email_len = text_length(email, MAX_EMAIL_LEN - 1);
+    User* user = arena_alloc(&repo->arena);
+    char* name_copy = string_pool_alloc(&repo->strings, name_len);
+    char* email_copy = string_pool_alloc(&repo->strings, email_len);
+    if (user == NULL || name_copy == NULL || email_copy == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        string_pool_release(&repo->strings, name_copy, name_len);
+        string_pool_release(&repo->strings, email_copy, email_len);
+        if (user != NULL) {
+            arena_release(&repo->arena, user);
         }
+        return NULL;
     }
 
-    return NULL;
+    user_init(user, text_copy(name_copy, name, name_len), name_len,
+              text_copy(email_copy, email, email_len), email_len, age);
+    user->in_arena = true;
+
+    if (!repository_add(repo, user)) {
+        repository_release_arena_user(repo, user);
+        return NULL;
+    }
+
+    return user;
+}
+
+User* repository_find_by_id(const UserRepository* repo, int id) {
+    if (repo == NULL) {
+        return NULL;
+    }
+
+    int slot = repository_slot_of(repo, id);
+    return slot >= 0 ? repo->users[slot] : NULL;
 }
 
+// Compacts pending tombstones so the returned array has no holes. Holes
+// are never visible to callers, so this keeps the const contract; every
+// repository comes from repository_create, so it is never a const object.
 User** repository_find_all(const UserRepository* repo, int* count) {
     if (repo == NULL || count == NULL) {
         return NULL;
     }
 
+    repository_compact((UserRepository*)repo);
     *count = repo->count;
-    return (User**)repo->users;
+    return repo->users;
+}
+
+// First slot from which every live user has an id above `after_id`.
+// Only for tombstone mode, where users sit in id order. The usual resume
+// id, the last one of a page, is still live and found through the index;
+// otherwise a binary search steps from each probe over any tombstones.
+static int repository_first_slot_after(const UserRepository* repo,
+                                       int after_id) {
+    int slot = repository_slot_of(repo, after_id);
+    if (slot >= 0) {
+        return slot + 1;
+    }
+
+    int lo = 0;
+    int hi = repo->length;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int probe = mid;
+        while (probe < hi && repo->users[probe] == NULL) {
+            probe++;
+        }
+        if (probe < hi && repo->users[probe]->id <= after_id) {
+            lo = probe + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compare_user_ids(const void* a, const void* b) {
+    int left = (*(User* const*)a)->id;
+    int right = (*(User* const*)b)->id;
+    return (left > right) - (left < right);
+}
+
+// Restores the max-heap on ids in heap[0, n) below position i
+static void user_heap_sift_down(User** heap, int n, int i) {
+    for (;;) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < n && heap[left]->id > heap[largest]->id) {
+            largest = left;
+        }
+        if (right < n && heap[right]->id > heap[largest]->id) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        User* moved = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = moved;
+        i = largest;
+    }
+}
+
+static void user_heap_push(User** heap, int n, User* user) {
+    int i = n;
+    heap[i] = user;
+    while (i > 0 && heap[(i - 1) / 2]->id < heap[i]->id) {
+        int parent = (i - 1) / 2;
+        heap[i] = heap[parent];
+        heap[parent] = user;
+        i = parent;
+    }
+}
+
+// Copies up to `cap` users with ids above `after_id` into `buf` in id
+// order and returns how many were copied. Pass the last id of a page
+// to resume; 0 means the scan is complete. In tombstone mode a call
+// costs O(page) plus any tombstones inside it. Swap mode does not keep
+// users in id order, so there the scan walks the live slots once, keeps
+// the `cap` lowest qualifying ids in a max-heap in `buf`, and sorts them:
+// O(count log cap), however many ids were removed.
+int repository_scan(const UserRepository* repo, int after_id, User** buf,
+                    int cap) {
+    if (repo == NULL || buf == NULL || cap <= 0 || after_id >= repo->next_id) {
+        return 0;
+    }
+
+    int copied = 0;
+    if (repo->remove_mode == REMOVE_TOMBSTONE) {
+        int i = repository_first_slot_after(repo, after_id);
+        for (; i < repo->length && copied < cap; i++) {
+            if (repo->users[i] != NULL) {
+                buf[copied++] = repo->users[i];
+            }
+        }
+        return copied;
+    }
+
+    for (int i = 0; i < repo->length; i++) {
+        User* user = repo->users[i];
+        if (user->id <= after_id) {
+            continue;
+        }
+        if (copied < cap) {
+            user_heap_push(buf, copied++, user);
+        } else if (user->id < buf[0]->id) {
+            buf[0] = user;
+            user_heap_sift_down(buf, copied, 0);
+        }
+    }
+    if (copied > 1) {
+        qsort(buf, copied, sizeof(User*), compare_user_ids);
+    }
+    return copied;
 }
 
 bool repository_remove(UserRepository* repo, int id) {
@@ -163,33 +812,143 @@ bool repository_remove(UserRepository* repo, int id) {
         return false;
     }
 
-    for (int i = 0; i < repo->count; i++) {
-        if (repo->users[i]->id == id) {
-            user_destroy(repo->users[i]);
+    int i = repository_slot_of(repo, id);
+    if (i < 0) {
+        return false;
+    }
 
-            // Shift remaining users
-            for (int j = i; j < repo->count - 1; j++) {
-                repo->users[j] = repo->users[j + 1];
-            }
+    age_stats_remove(&repo->ages, repo->users[i]->age);
+    if (repo->users[i]->in_arena) {
+        repository_release_arena_user(repo, repo->users[i]);
+    } else {
+        user_destroy(repo->users[i]);
+        repo->heap_users--;
+    }
+    repo->slot_of_id[id] = 0;
+    repo->count--;
+
+    if (repo->remove_mode == REMOVE_SWAP) {
+        User* last = repo->users[--repo->length];
+        if (i < repo->length) {
+            repo->users[i] = last;
+            repo->slot_of_id[last->id] = i + 1;
+        }
+        repo->users[repo->length] = NULL;
+        return true;
+    }
+
+    repo->users[i] = NULL;
+    repo->tombstones++;
+    if ((long long)repo->tombstones * 100 >=
+        (long long)repo->length * repo->compact_percent) {
+        repository_compact(repo);
+    }
+    return true;
+}
+
+// Squeeze out tombstones in one pass, keeping the remaining order
+void repository_compact(UserRepository* repo) {
+    if (repo == NULL || repo->tombstones == 0) {
+        return;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < repo->length; i++) {
+        if (repo->users[i] != NULL) {
+            repo->users[kept] = repo->users[i];
+            repo->slot_of_id[repo->users[kept]->id] = kept + 1;
+            kept++;
+        }
+    }
+
+    repo->length = kept;
+    repo->tombstones = 0;
+}
+
+// Switching modes compacts first, so swap mode never sees tombstones.
+// Leaving swap mode sorts the users back into the id order that
+// tombstone mode keeps.
+void repository_set_remove_mode(UserRepository* repo, RemoveMode mode,
+                                int compact_percent) {
+    if (repo == NULL) {
+        return;
+    }
 
-            repo->users[repo->count - 1] = NULL;
-            repo->count--;
-            return true;
+    repository_compact(repo);
+    if (repo->remove_mode == REMOVE_SWAP && mode == REMOVE_TOMBSTONE &&
+        repo->length > 1) {
+        qsort(repo->users, repo->length, sizeof(User*), compare_user_ids);
+        for (int i = 0; i < repo->length; i++) {
+            repo->slot_of_id[repo->users[i]->id] = i + 1;
         }
     }
+    repo->remove_mode = mode;
+    if (compact_percent > 0 && compact_percent <= 100) {
+        repo->compact_percent = compact_percent;
+    }
+}
+
+// Updates the age through the repository so its aggregates stay correct
+bool repository_set_age(UserRepository* repo, int id, int age) {
+    if (age < 0 || age > MAX_AGE) {
+        fprintf(stderr, "Error: invalid age %d\n", age);
+        return false;
+    }
+
+    User* user = repository_find_by_id(repo, id);
+    if (user == NULL) {
+        return false;
+    }
+
+    age_stats_remove(&repo->ages, user->age);
+    user->age = age;
+    age_stats_add(&repo->ages, age);
+    return true;
+}
 
-    return false;
+int repository_count_adults(const UserRepository* repo) {
+    return repo != NULL ? repo->ages.adults : 0;
+}
+
+bool repository_age_range(UserRepository* repo, int* min_age, int* max_age) {
+    if (repo == NULL || repo->count == 0) {
+        return false;
+    }
+
+    age_stats_refresh(&repo->ages);
+    if (min_age != NULL) *min_age = repo->ages.min_age;
+    if (max_age != NULL) *max_age = repo->ages.max_age;
+    return true;
+}
+
+// Dumps every user with one write per WRITER_BUFFER_SIZE block
+void repository_write_all(UserRepository* repo, FILE* out) {
+    if (repo == NULL || out == NULL) {
+        return;
+    }
+
+    UserWriter writer;
+    writer_init(&writer, out);
+    for (int i = 0; i < repo->length; i++) {
+        if (repo->users[i] != NULL) {
+            writer_write(&writer, NULL, repo->users[i]);
+        }
+    }
+    writer_flush(&writer);
 }
 
 // Helper functions
 void print_adults(const UserRepository* repo) {
+    UserWriter writer;
+    writer_init(&writer, stdout);
+
     printf("\nAdult users:\n");
-    for (int i = 0; i < repo->count; i++) {
+    for (int i = 0; i < repo->length; i++) {
         if (user_is_adult(repo->users[i])) {
-            printf("  ");
-            user_print(repo->users[i]);
+            writer_write(&writer, "  ", repo->users[i]);
         }
     }
+    writer_flush(&writer);
 }
 
 double calculate_average_age(const UserRepository* repo) {
@@ -197,12 +956,7 @@ double calculate_average_age(const UserRepository* repo) {
         return 0.0;
     }
 
-    int total_age = 0;
-    for (int i = 0; i < repo->count; i++) {
-        total_age += repo->users[i]->age;
-    }
-
-    return (double)total_age / repo->count;
+    return (double)repo->ages.sum / repo->count;
 }
 
 // Array operations
@@ -282,8 +1036,257 @@ void demonstrate_pointers(void) {
     printf("Pointer value: %d\n", *ptr);
 }
 
+// Benchmarks, run as `example --bench [max-users] [repetitions]`. Sizes
+// grow 10x from 100 up to max-users (default 10^7), and each size is set
+// up and timed `repetitions` times (default 5). Results go to stdout as
+// JSON in Google Benchmark's layout, each repetition followed by the
+// median, min and max, so the usual comparison tooling reads them.
+#define BENCH_LOOKUPS 1000000
+#define BENCH_DEFAULT_MAX_USERS 10000000L
+#define BENCH_DEFAULT_REPETITIONS 5
+#define BENCH_MAX_REPETITIONS 1000
+
+// What bench_run_size times, in output order
+enum {
+    BENCH_ADD,
+    BENCH_FIND_UNIFORM,
+    BENCH_FIND_SKEWED,
+    BENCH_AVERAGE_AGE,
+    BENCH_REMOVE,
+    BENCH_METRICS
+};
+
+static const char* const bench_names[BENCH_METRICS] = {
+    "repository_add", "repository_find_by_id/uniform",
+    "repository_find_by_id/skewed", "calculate_average_age",
+    "repository_remove",
+};
+
+static volatile long bench_sink; // keeps benchmarked results alive
+static int bench_results = 0;
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// xorshift64*: cheap and identical from run to run
+static uint64_t bench_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double bench_per_op(long iterations, double start_ns) {
+    return (bench_now_ns() - start_ns) / (double)iterations;
+}
+
+static int bench_compare_doubles(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+// Prints every repetition of one benchmark, then its median, min and
+// max; sorts `samples` in place
+static void bench_report(int metric, long users, long iterations,
+                         double* samples, int repetitions) {
+    const char* name = bench_names[metric];
+    for (int i = 0; i < repetitions; i++) {
+        printf("%s    {\"name\": \"%s/%ld\", \"run_name\": \"%s/%ld\", "
+               "\"run_type\": \"iteration\", \"repetitions\": %d, "
+               "\"repetition_index\": %d, \"iterations\": %ld, "
+               "\"real_time\": %.3f, \"time_unit\": \"ns\"}",
+               bench_results++ > 0 ? ",\n" : "", name, users, name, users,
+               repetitions, i, iterations, samples[i]);
+    }
+
+    qsort(samples, repetitions, sizeof(double), bench_compare_doubles);
+    double median = repetitions % 2
+                        ? samples[repetitions / 2]
+                        : (samples[repetitions / 2 - 1] +
+                           samples[repetitions / 2]) / 2;
+
+    const char* aggregates[] = {"median", "min", "max"};
+    double values[] = {median, samples[0], samples[repetitions - 1]};
+    for (int i = 0; i < 3; i++) {
+        printf(",\n    {\"name\": \"%s/%ld_%s\", \"run_name\": \"%s/%ld\", "
+               "\"run_type\": \"aggregate\", \"repetitions\": %d, "
+               "\"aggregate_name\": \"%s\", \"iterations\": %ld, "
+               "\"real_time\": %.3f, \"time_unit\": \"ns\"}",
+               name, users, aggregates[i], name, users,
+               repetitions, aggregates[i], iterations, values[i]);
+    }
+}
+
+// Ids in [1, users]. The skewed stream cubes a uniform draw, so half of
+// the lookups land on the first eighth of the ids.
+static int* bench_access_pattern(long users, long count, bool skewed) {
+    int* ids = malloc(count * sizeof(int));
+    if (ids == NULL) {
+        return NULL;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)users;
+    for (long i = 0; i < count; i++) {
+        double u = (double)(bench_random(&state) >> 11) / 9007199254740992.0;
+        if (skewed) {
+            u = u * u * u;
+        }
+        ids[i] = 1 + (int)(u * (double)users);
+    }
+    return ids;
+}
+
+// Every id in [1, users] once, in random order
+static int* bench_shuffled_ids(long users) {
+    int* ids = malloc(users * sizeof(int));
+    if (ids == NULL) {
+        return NULL;
+    }
+
+    uint64_t state = 0xD1B54A32D192ED03ULL ^ (uint64_t)users;
+    for (long i = 0; i < users; i++) {
+        ids[i] = (int)(i + 1);
+    }
+    for (long i = users; i > 1; i--) {
+        swap(&ids[i - 1], &ids[bench_random(&state) % (uint64_t)i]);
+    }
+    return ids;
+}
+
+// One repetition at `users` users; per_op[metric] gets each result in ns
+static bool bench_run_size(long users, double* per_op) {
+    UserRepository* repo = repository_create();
+    User** created = malloc(users * sizeof(User*));
+    int* removals = bench_shuffled_ids(users);
+    int* lookups[2] = {bench_access_pattern(users, BENCH_LOOKUPS, false),
+                       bench_access_pattern(users, BENCH_LOOKUPS, true)};
+    if (repo == NULL || created == NULL || removals == NULL ||
+        lookups[0] == NULL || lookups[1] == NULL) {
+        repository_destroy(repo);
+        free(created);
+        free(removals);
+        free(lookups[0]);
+        free(lookups[1]);
+        return false;
+    }
+
+    char email[MAX_EMAIL_LEN];
+    user_clock_hold();
+    for (long i = 0; i < users; i++) {
+        snprintf(email, sizeof(email), "user%ld@example.com", i);
+        created[i] = user_create("user", email, (int)(i % 100));
+    }
+    user_clock_release();
+
+    double start = bench_now_ns();
+    for (long i = 0; i < users; i++) {
+        repository_add(repo, created[i]);
+    }
+    per_op[BENCH_ADD] = bench_per_op(users, start);
+    free(created);
+
+    for (int skewed = 0; skewed <= 1; skewed++) {
+        const int* ids = lookups[skewed];
+        long hits = 0;
+        start = bench_now_ns();
+        for (long i = 0; i < BENCH_LOOKUPS; i++) {
+            hits += repository_find_by_id(repo, ids[i]) != NULL;
+        }
+        bench_sink = hits;
+        per_op[skewed ? BENCH_FIND_SKEWED : BENCH_FIND_UNIFORM] =
+            bench_per_op(BENCH_LOOKUPS, start);
+        free(lookups[skewed]);
+    }
+
+    double total = 0.0;
+    start = bench_now_ns();
+    for (long i = 0; i < BENCH_LOOKUPS; i++) {
+        total += calculate_average_age(repo);
+    }
+    bench_sink = (long)total;
+    per_op[BENCH_AVERAGE_AGE] = bench_per_op(BENCH_LOOKUPS, start);
+
+    start = bench_now_ns();
+    for (long i = 0; i < users; i++) {
+        repository_remove(repo, removals[i]);
+    }
+    per_op[BENCH_REMOVE] = bench_per_op(users, start);
+
+    free(removals);
+    repository_destroy(repo);
+    return true;
+}
+
+static int run_benchmarks(long max_users, int repetitions,
+                          const char* executable) {
+    double* samples = malloc(sizeof(double) * BENCH_METRICS * repetitions);
+    if (samples == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        return 1;
+    }
+
+    printf("{\n  \"context\": {\"executable\": \"%s\"},\n"
+           "  \"benchmarks\": [\n", executable);
+    for (long users = 100; users <= max_users; users *= 10) {
+        // samples[metric * repetitions + repetition]
+        for (int r = 0; r < repetitions; r++) {
+            double per_op[BENCH_METRICS];
+            if (!bench_run_size(users, per_op)) {
+                fprintf(stderr, "Error: benchmark setup failed at %ld users\n",
+                        users);
+                free(samples);
+                return 1;
+            }
+            for (int metric = 0; metric < BENCH_METRICS; metric++) {
+                samples[metric * repetitions + r] = per_op[metric];
+            }
+        }
+        for (int metric = 0; metric < BENCH_METRICS; metric++) {
+            long iterations = metric == BENCH_ADD || metric == BENCH_REMOVE
+                                  ? users
+                                  : BENCH_LOOKUPS;
+            bench_report(metric, users, iterations,
+                         samples + metric * repetitions, repetitions);
+        }
+    }
+    printf("\n  ]\n}\n");
+    free(samples);
+    return 0;
+}
+
 // Main function
 int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        long max_users = BENCH_DEFAULT_MAX_USERS;
+        long repetitions = BENCH_DEFAULT_REPETITIONS;
+        char* end;
+        errno = 0;
+        if (argc > 2) {
+            max_users = strtol(argv[2], &end, 10);
+            // Ids are ints and stop below INT_MAX
+            if (end == argv[2] || *end != '\0' || max_users >= INT_MAX) {
+                max_users = 0;
+            }
+        }
+        if (argc > 3) {
+            repetitions = strtol(argv[3], &end, 10);
+            if (end == argv[3] || *end != '\0' ||
+                repetitions > BENCH_MAX_REPETITIONS) {
+                repetitions = 0;
+            }
+        }
+        if (errno != 0 || max_users <= 0 || repetitions <= 0 || argc > 4) {
+            fprintf(stderr, "usage: %s --bench [max-users] [repetitions]\n",
+                    argv[0]);
+            return 1;
+        }
+        return run_benchmarks(max_users, (int)repetitions, argv[0]);
+    }
+
     printf("C User Management System\n");
     printf("API Version: %s\n", API_VERSION);
 
@@ -294,23 +1297,26 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Create users
+    // Pre-size for the users below
+    repository_reserve(repo, 3);
+
+    // Create users on the heap, then hand them to the repository; the
+    // hold gives the whole batch one creation time
+    user_clock_hold();
     User* alice = user_create("Alice Johnson", "alice@example.com", 28);
     User* bob = user_create("Bob Smith", "bob@example.com", 17);
-    User* charlie = user_create("Charlie Brown", "charlie@example.com", 45);
+    user_clock_release();
 
     // Add to repository
     if (alice) repository_add(repo, alice);
     if (bob) repository_add(repo, bob);
-    if (charlie) repository_add(repo, charlie);
+
+    // Create a user directly in the repository's arena
+    user_create_in(repo, "Charlie Brown", "charlie@example.com", 45);
 
     // Print all users
     printf("\nAll users:\n");
-    int count;
-    User** users = repository_find_all(repo, &count);
-    for (int i = 0; i < count; i++) {
-        user_print(users[i]);
-    }
+    repository_write_all(repo, stdout);
 
     // Print adults
     print_adults(repo);
@@ -318,6 +1324,19 @@ int main(int argc, char* argv[]) {
     // Calculate average age
     double avg_age = calculate_average_age(repo);
     printf("\nAverage age: %.2f\n", avg_age);
+    printf("Adult count: %d\n", repository_count_adults(repo));
+
+    // Page through the repository two users at a time
+    printf("\nPaged scan:\n");
+    User* page[2];
+    int last_id = 0;
+    int page_size;
+    while ((page_size = repository_scan(repo, last_id, page, 2)) > 0) {
+        for (int i = 0; i < page_size; i++) {
+            printf("  %d: %s\n", page[i]->id, page[i]->name);
+        }
+        last_id = page[page_size - 1]->id;
+    }
 
     // Find by ID
     User* found = repository_find_by_id(repo, 1);
@@ -2,15 +2,63 @@
 // Testing: comments, strings, numbers, keywords, templates, lambdas
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <concepts>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+// std::execution needs a backend (TBB under libstdc++), so it is opt-in
+#if defined(USE_STD_EXECUTION) && __has_include(<execution>)
+#include <execution>
+#define HAVE_STD_EXECUTION 1
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "example.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 using namespace std;
 
 // Constants
@@ -18,146 +66,5551 @@ constexpr int MAX_USERS = 1000;
 constexpr double PI = 3.14159265359;
 const string API_VERSION = "v1.0";
 
-/**
- * User class with modern C++ features
- */
-class User {
-private:
-  int id;
-  string name;
-  string email;
-  int age;
-  chrono::system_clock::time_point createdAt;
+/**
+ * Process-wide store for user strings. Each string is length-prefixed
+ * inside a 64 KiB chunk and addressed by a 32-bit offset
+ * (chunk << 16 | position). Chunks never move, so reads take no lock.
+ * Email domains are interned once and shared by every address using them
+ * and live as long as the store. Released strings go on a free list per
+ * 8-byte size class and the next string of that class reuses the space;
+ * while a Pin is alive they are parked instead, so offsets copied before
+ * (e.g. by a snapshot still being written) keep resolving.
+ *
+ * Chunks are filled per lane, one lane per NUMA node, and a released
+ * string is reused only within its chunk's lane. Offsets share one space
+ * whatever the lane, so reads never need to know it. Each lane has its
+ * own lock, so writers on different lanes only meet when a chunk is added.
+ */
+class StringStore {
+public:
+  static constexpr uint32_t NoString = UINT32_MAX;
+
+private:
+  static constexpr size_t ChunkBits = 16;
+  static constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+  static constexpr size_t MaxChunks = size_t(1) << (32 - ChunkBits);
+  static constexpr size_t MaxLength = ChunkSize - sizeof(uint16_t);
+  static constexpr size_t Granule = 8;
+  static constexpr size_t MaxLanes = size_t(UINT8_MAX) + 1;
+
+  struct Lane {
+    mutex lock; // guards the rest of the lane but `bytes`
+    atomic<size_t> bytes{0}; // held by its live strings
+    size_t chunk = 0;
+    size_t used = ChunkSize; // forces a chunk on the first append
+    vector<size_t> spare;    // reserved chunks not filled yet
+    vector<vector<uint32_t>> freeLists =
+        vector<vector<uint32_t>>(ChunkSize / Granule + 1);
+  };
+
+  unique_ptr<atomic<char *>[]> chunks =
+      make_unique<atomic<char *>[]>(MaxChunks);
+  // Lane of every chunk, set before the chunk is handed out
+  unique_ptr<uint8_t[]> chunkLanes = make_unique<uint8_t[]>(MaxChunks);
+  array<atomic<Lane *>, MaxLanes> lanes{};
+  vector<unique_ptr<Lane>> ownedLanes;
+  size_t chunkCount = 0;
+  mutex growLock; // guards chunkCount and ownedLanes
+  unordered_map<string_view, uint32_t> domains;
+  mutex domainLock;
+  vector<uint32_t> parked; // released while pinned
+  atomic<size_t> pins{0};  // changed only under pinLock
+  mutex pinLock;
+
+  static inline thread_local size_t currentLane = 0;
+
+  // Bytes taken by a string of `length`, prefix included
+  static size_t footprint(size_t length) {
+    return (sizeof(uint16_t) + length + Granule - 1) / Granule * Granule;
+  }
+
+  char *at(uint32_t offset) const {
+    return chunks[offset >> ChunkBits].load(memory_order_acquire) +
+           (offset & (ChunkSize - 1));
+  }
+
+  Lane &laneOf(uint32_t offset) {
+    return *lanes[chunkLanes[offset >> ChunkBits]].load(memory_order_acquire);
+  }
+
+  void recycle(uint32_t offset) {
+    uint16_t length;
+    memcpy(&length, at(offset), sizeof(length));
+    Lane &lane = laneOf(offset);
+    lock_guard guard(lane.lock);
+    lane.freeLists[footprint(length) / Granule].push_back(offset);
+  }
+
+  Lane &laneAt(size_t index) {
+    if (index >= MaxLanes) {
+      throw out_of_range("StringStore lane out of range");
+    }
+    if (Lane *lane = lanes[index].load(memory_order_acquire)) {
+      return *lane;
+    }
+    lock_guard guard(growLock);
+    if (Lane *lane = lanes[index].load(memory_order_relaxed)) {
+      return *lane;
+    }
+    ownedLanes.push_back(make_unique<Lane>());
+    lanes[index].store(ownedLanes.back().get(), memory_order_release);
+    return *ownedLanes.back();
+  }
+
+  size_t addChunk(size_t lane) {
+    lock_guard guard(growLock);
+    if (chunkCount == MaxChunks) {
+      throw length_error("StringStore is full");
+    }
+    chunkLanes[chunkCount] = static_cast<uint8_t>(lane);
+    chunks[chunkCount].store(new char[ChunkSize], memory_order_release);
+    return chunkCount++;
+  }
+
+  // Caller holds lane.lock
+  uint32_t append(Lane &lane, size_t index, string_view text) {
+    if (text.size() > MaxLength) {
+      throw length_error("String too long for StringStore");
+    }
+    size_t need = footprint(text.size());
+    uint32_t offset;
+    if (auto &reuse = lane.freeLists[need / Granule]; !reuse.empty()) {
+      offset = reuse.back();
+      reuse.pop_back();
+    } else {
+      if (lane.used + need > ChunkSize) {
+        if (lane.spare.empty()) {
+          lane.chunk = addChunk(index);
+        } else {
+          lane.chunk = lane.spare.back();
+          lane.spare.pop_back();
+        }
+        lane.used = 0;
+      }
+      offset = static_cast<uint32_t>((lane.chunk << ChunkBits) | lane.used);
+      lane.used += need;
+    }
+
+    char *base = at(offset);
+    uint16_t length = static_cast<uint16_t>(text.size());
+    memcpy(base, &length, sizeof(length));
+    memcpy(base + sizeof(length), text.data(), text.size());
+    lane.bytes.fetch_add(need, memory_order_relaxed);
+    return offset;
+  }
+
+public:
+  StringStore() = default;
+  StringStore(const StringStore &) = delete;
+  StringStore &operator=(const StringStore &) = delete;
+
+  ~StringStore() {
+    for (size_t i = 0; i < chunkCount; ++i) {
+      delete[] chunks[i].load(memory_order_relaxed);
+    }
+  }
+
+  static StringStore &instance() {
+    static StringStore store;
+    return store;
+  }
+
+  uint32_t add(string_view text) {
+    size_t index = currentLane;
+    Lane &lane = laneAt(index);
+    lock_guard guard(lane.lock);
+    return append(lane, index, text);
+  }
+
+  // Strings added on this thread go to `lane` while it lives
+  class LaneScope {
+  public:
+    explicit LaneScope(size_t lane) : previous(currentLane) {
+      currentLane = lane;
+    }
+    ~LaneScope() { currentLane = previous; }
+    LaneScope(const LaneScope &) = delete;
+    LaneScope &operator=(const LaneScope &) = delete;
+
+  private:
+    size_t previous;
+  };
+
+  /**
+   * Sets aside chunks for `bytes` of strings in `lane` and writes every
+   * page of them, so calling this on a thread pinned to a node places
+   * the lane's first chunks on that node.
+   */
+  void reserveLane(size_t lane, size_t bytes) {
+    Lane &reserved = laneAt(lane);
+    lock_guard guard(reserved.lock);
+    for (size_t held = 0; held < bytes; held += ChunkSize) {
+      size_t chunk = addChunk(lane);
+      memset(chunks[chunk].load(memory_order_relaxed), 0, ChunkSize);
+      reserved.spare.push_back(chunk);
+    }
+  }
+
+  // Same domain text always yields the same offset
+  uint32_t internDomain(string_view domain) {
+    lock_guard guard(domainLock);
+    if (auto it = domains.find(domain); it != domains.end()) {
+      return it->second;
+    }
+    size_t index = currentLane;
+    Lane &lane = laneAt(index);
+    uint32_t offset;
+    {
+      lock_guard laneGuard(lane.lock);
+      offset = append(lane, index, domain);
+    }
+    domains.emplace(get(offset), offset);
+    return offset;
+  }
+
+  /**
+   * Hands a string added with add() back for reuse. The caller must be
+   * its last user: nothing may read the offset afterwards unless a Pin
+   * was taken before the release. Interned domains are never released.
+   */
+  void release(uint32_t offset) {
+    if (offset == NoString) {
+      return;
+    }
+    uint16_t length;
+    memcpy(&length, at(offset), sizeof(length));
+    laneOf(offset).bytes.fetch_sub(footprint(length), memory_order_relaxed);
+    if (pins.load() > 0) {
+      lock_guard guard(pinLock);
+      if (pins.load(memory_order_relaxed) > 0) {
+        parked.push_back(offset);
+        return;
+      }
+    }
+    recycle(offset);
+  }
+
+  // Holds back reuse of released strings for as long as it lives
+  class Pin {
+  public:
+    Pin() {
+      StringStore &store = instance();
+      lock_guard guard(store.pinLock);
+      store.pins.fetch_add(1);
+    }
+    ~Pin() {
+      StringStore &store = instance();
+      lock_guard guard(store.pinLock);
+      if (store.pins.fetch_sub(1) == 1) {
+        for (uint32_t offset : store.parked) {
+          store.recycle(offset);
+        }
+        store.parked.clear();
+      }
+    }
+    Pin(const Pin &) = delete;
+    Pin &operator=(const Pin &) = delete;
+  };
+
+  string_view get(uint32_t offset) const {
+    if (offset == NoString) {
+      return {};
+    }
+    const char *base = at(offset);
+    uint16_t length;
+    memcpy(&length, base, sizeof(length));
+    return {base + sizeof(length), length};
+  }
+
+  // Bytes held by live strings
+  size_t bytesUsed() const {
+    size_t total = 0;
+    for (const auto &slot : lanes) {
+      if (const Lane *lane = slot.load(memory_order_acquire)) {
+        total += lane->bytes.load(memory_order_relaxed);
+      }
+    }
+    return total;
+  }
+};
+
+// Offsets of a user's strings inside the StringStore
+struct UserStrings {
+  uint32_t name = StringStore::NoString;
+  uint32_t emailLocal = StringStore::NoString;
+  uint32_t emailDomain = StringStore::NoString;
+};
+
+/**
+ * Email address resolved from its stored local and domain parts
+ */
+struct EmailView {
+  string_view local;
+  string_view domain;
+  bool hasDomain = false;
+
+  size_t size() const {
+    return local.size() + (hasDomain ? domain.size() + 1 : 0);
+  }
+
+  string str() const {
+    string text(local);
+    if (hasDomain) {
+      text += '@';
+      text += domain;
+    }
+    return text;
+  }
+
+  bool operator==(const EmailView &other) const = default;
+
+  bool operator==(string_view text) const {
+    if (text.size() != size() || !text.starts_with(local)) {
+      return false;
+    }
+    return !hasDomain || (text[local.size()] == '@' &&
+                          text.substr(local.size() + 1) == domain);
+  }
+
+  friend ostream &operator<<(ostream &os, const EmailView &email) {
+    os << email.local;
+    if (email.hasDomain) {
+      os << '@' << email.domain;
+    }
+    return os;
+  }
+};
+
+// Views into `email`; splits at the last '@' like the stored form
+inline EmailView splitEmail(string_view email) {
+  size_t at = email.rfind('@');
+  if (at == string_view::npos) {
+    return {email, {}, false};
+  }
+  return {email.substr(0, at), email.substr(at + 1), true};
+}
+
+inline EmailView resolveEmail(const UserStrings &strings) {
+  const StringStore &store = StringStore::instance();
+  return {store.get(strings.emailLocal), store.get(strings.emailDomain),
+          strings.emailDomain != StringStore::NoString};
+}
+
+#ifndef USER_CLOCK_TICK_MS
+#define USER_CLOCK_TICK_MS 1000
+#endif
+
+/**
+ * Creation timestamps as 32-bit tick counts since 2020-01-01 UTC. The
+ * tick length, USER_CLOCK_TICK_MS, trades precision for range: 1 s ticks
+ * last until 2156, 100 ms ticks until 2033. now() reads the kernel's
+ * coarse realtime clock where there is one; it is served from memory
+ * without touching the timer and lags the precise clock by at most a
+ * scheduler tick, which is far below the stored precision anyway.
+ */
+struct CoarseClock {
+  using Ticks = uint32_t;
+  using time_point = chrono::system_clock::time_point;
+
+  static constexpr int64_t TickMillis = USER_CLOCK_TICK_MS;
+  static constexpr int64_t EpochMillis = 1577836800000;
+  static_assert(TickMillis > 0, "USER_CLOCK_TICK_MS must be positive");
+
+  // Times outside the representable range are rejected rather than
+  // clamped, so a restore or replay never silently moves a timestamp
+  static Ticks fromMillis(int64_t unixMillis) {
+    if (unixMillis < EpochMillis ||
+        (unixMillis - EpochMillis) / TickMillis > int64_t(UINT32_MAX)) {
+      throw out_of_range("Time outside the CoarseClock range");
+    }
+    return static_cast<Ticks>((unixMillis - EpochMillis) / TickMillis);
+  }
+
+  static Ticks now() { return holds > 0 ? heldAt : read(); }
+
+  // Between hold() and release(), now() on this thread keeps returning
+  // the reading taken by the outermost hold(); holds nest
+  static void hold() {
+    if (holds++ == 0) {
+      heldAt = read();
+    }
+  }
+
+  static void release() {
+    if (holds > 0) {
+      --holds;
+    }
+  }
+
+  static Ticks fromTimePoint(time_point time) {
+    return fromMillis(chrono::duration_cast<chrono::milliseconds>(
+                          time.time_since_epoch())
+                          .count());
+  }
+
+  static time_point toTimePoint(Ticks ticks) {
+    return time_point(chrono::duration_cast<chrono::system_clock::duration>(
+        chrono::milliseconds(EpochMillis + int64_t(ticks) * TickMillis)));
+  }
+
+private:
+  static inline thread_local int holds = 0;
+  static inline thread_local Ticks heldAt = 0;
+
+  static Ticks read() {
+#ifdef CLOCK_REALTIME_COARSE
+    timespec ts;
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+      return fromMillis(int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000);
+    }
+#endif
+    return fromTimePoint(chrono::system_clock::now());
+  }
+};
+
+class User;
+
+// Notified whenever a stored user's fields change
+class UserListener {
+public:
+  virtual ~UserListener() = default;
+  virtual void onUserChanged(const User &user) = 0;
+};
+
+/**
+ * User class with modern C++ features
+ */
+class User {
+private:
+  int id;
+  UserStrings strings;
+  int age;
+  CoarseClock::Ticks createdAt;
+  UserListener *listener = nullptr;
+
+  void notify() {
+    if (listener != nullptr) {
+      listener->onUserChanged(*this);
+    }
+  }
+
+  // Stores the local part per user and interns the domain
+  void storeEmail(const EmailView &parts) {
+    StringStore &store = StringStore::instance();
+    strings.emailLocal = store.add(parts.local);
+    strings.emailDomain = parts.hasDomain ? store.internDomain(parts.domain)
+                                          : StringStore::NoString;
+  }
+
+  // A listener may veto a change by throwing; the old value is restored
+  template <typename Field, typename Apply>
+  void change(Field &field, Apply &&apply) {
+    Field previous = field;
+    apply();
+    try {
+      notify();
+    } catch (...) {
+      field = previous;
+      throw;
+    }
+  }
+
+  // change() for the string offsets: whichever side loses, the replaced
+  // strings or the vetoed ones, goes back to the store. Listeners see
+  // both versions, so the old strings are released only after notify().
+  template <typename Apply> void changeStrings(Apply &&apply) {
+    UserStrings previous = strings;
+    try {
+      apply();
+      notify();
+    } catch (...) {
+      releaseUnshared(strings, previous);
+      strings = previous;
+      throw;
+    }
+    releaseUnshared(previous, strings);
+  }
+
+  // Releases the strings of `gone` that `kept` does not point at;
+  // domains are interned and stay
+  static void releaseUnshared(const UserStrings &gone,
+                              const UserStrings &kept) {
+    StringStore &store = StringStore::instance();
+    if (gone.name != kept.name) {
+      store.release(gone.name);
+    }
+    if (gone.emailLocal != kept.emailLocal) {
+      store.release(gone.emailLocal);
+    }
+  }
+
+  // Stores both strings or neither: a constructor that throws runs no
+  // destructor, so a name stored before a failing email is released here
+  static UserStrings storeStrings(string_view name, const EmailView &email) {
+    StringStore &store = StringStore::instance();
+    UserStrings stored;
+    try {
+      stored.name = store.add(name);
+      stored.emailLocal = store.add(email.local);
+      if (email.hasDomain) {
+        stored.emailDomain = store.internDomain(email.domain);
+      }
+    } catch (...) {
+      releaseUnshared(stored, {});
+      throw;
+    }
+    return stored;
+  }
+
+public:
+  // Constructor with member initializer list. Strings are copied straight
+  // into the StringStore, so views avoid any temporary std::string.
+  User(int id, string_view name, string_view email, int age)
+      : User(id, name, email, age, CoarseClock::now()) {}
+
+  // Takes a clock reading from the caller, so a batch can share one
+  User(int id, string_view name, string_view email, int age,
+       CoarseClock::Ticks createdAt)
+      : User(id, name, splitEmail(email), age, createdAt) {}
+
+  User(int id, string_view name, const EmailView &email, int age,
+       CoarseClock::Ticks createdAt)
+      : id(id), strings(storeStrings(name, email)), age(age),
+        createdAt(createdAt) {}
+
+  // Rebuilds a stored user, keeping its id and creation time. The time is
+  // converted first, so an out-of-range one throws before storing strings.
+  User(int id, string_view name, const EmailView &email, int age,
+       chrono::system_clock::time_point createdAt)
+      : User(id, name, email, age, CoarseClock::fromTimePoint(createdAt)) {}
+
+  // Each user owns its strings, so copies would release them twice
+  User(const User &) = delete;
+  User &operator=(const User &) = delete;
+
+  User(User &&other) noexcept
+      : id(other.id), strings(exchange(other.strings, {})), age(other.age),
+        createdAt(other.createdAt), listener(other.listener) {}
+
+  User &operator=(User &&other) noexcept {
+    if (this != &other) {
+      releaseUnshared(strings, {});
+      id = other.id;
+      strings = exchange(other.strings, {});
+      age = other.age;
+      createdAt = other.createdAt;
+      listener = other.listener;
+    }
+    return *this;
+  }
+
+  ~User() { releaseUnshared(strings, {}); }
+
+  // Getters
+  int getId() const { return id; }
+  string_view getName() const {
+    return StringStore::instance().get(strings.name);
+  }
+  EmailView getEmail() const { return resolveEmail(strings); }
+  const UserStrings &getStrings() const { return strings; }
+  int getAge() const { return age; }
+  chrono::system_clock::time_point getCreatedAt() const {
+    return CoarseClock::toTimePoint(createdAt);
+  }
+  CoarseClock::Ticks getCreatedTicks() const { return createdAt; }
+
+  // Setters. Setting a string to its current value stores nothing:
+  // index keys view the stored bytes and would outlive a same-value copy.
+  void setId(int newId) { id = newId; }
+  void setName(string_view newName) {
+    if (newName == getName()) {
+      return;
+    }
+    changeStrings([&] { strings.name = StringStore::instance().add(newName); });
+  }
+  void setEmail(string_view newEmail) { setEmail(splitEmail(newEmail)); }
+  void setEmail(const EmailView &newEmail) {
+    if (newEmail == getEmail()) {
+      return;
+    }
+    changeStrings([&] { storeEmail(newEmail); });
+  }
+  void setAge(int newAge) {
+    change(age, [&] { age = newAge; });
+  }
+  void setListener(UserListener *newListener) { listener = newListener; }
+
+  // Computed property
+  bool isAdult() const { return age >= 18; }
+
+  // Friend function for output
+  friend ostream &operator<<(ostream &os, const User &user);
+};
+
+/**
+ * Serializers that render values into a caller-supplied buffer. write()
+ * picks the encoding for each type at compile time: to_chars for
+ * numbers, quoted strings copied in blocks between escapes, "[a, b]" for
+ * ranges and the User{...} record layout for anything user-shaped.
+ * Other types with an operator<< are streamed straight into the buffer.
+ */
+namespace serial {
+
+/**
+ * Fixed output window with snprintf semantics: pieces are copied while
+ * they fit, size() keeps counting, and fits() tells whether the output
+ * is complete. A piece that does not fit ends the copying for good.
+ */
+class Buffer {
+private:
+  char *data;
+  size_t capacity;
+  size_t length = 0;
+
+public:
+  Buffer(char *data, size_t capacity) : data(data), capacity(capacity) {}
+
+  void append(string_view bytes) {
+    if (length + bytes.size() <= capacity) {
+      memcpy(data + length, bytes.data(), bytes.size());
+    }
+    length += bytes.size();
+  }
+
+  void put(char c) { append({&c, 1}); }
+
+  size_t size() const { return length; }
+  bool fits() const { return length <= capacity; }
+};
+
+// Lets operator<< write into a Buffer, with the same truncation rules
+class BufferStreambuf : public streambuf {
+private:
+  Buffer &out;
+
+protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      out.put(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  streamsize xsputn(const char *bytes, streamsize count) override {
+    out.append({bytes, size_t(count)});
+    return count;
+  }
+
+public:
+  explicit BufferStreambuf(Buffer &out) : out(out) {}
+};
+
+template <typename T>
+concept Number =
+    is_arithmetic_v<T> && !is_same_v<T, bool> && !is_same_v<T, char>;
+
+template <typename T>
+concept Text = is_convertible_v<const T &, string_view>;
+
+template <typename T>
+concept Sequence = !Text<T> && requires(const T &range) {
+  begin(range);
+  end(range);
+};
+
+template <typename T>
+concept Streamable = requires(ostream &os, const T &value) { os << value; };
+
+template <typename T>
+concept UserRecord = requires(const T &user) {
+  { user.getId() } -> convertible_to<int>;
+  { user.getName() } -> convertible_to<string_view>;
+  { user.getAge() } -> convertible_to<int>;
+};
+
+// Copies runs of plain bytes in one piece; only quotes, backslashes and
+// control characters are written one at a time
+inline void writeEscaped(Buffer &out, string_view text) {
+  constexpr char Hex[] = "0123456789abcdef";
+  size_t run = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    auto c = static_cast<unsigned char>(text[i]);
+    if (c != '"' && c != '\\' && c >= 0x20) {
+      continue;
+    }
+    out.append(text.substr(run, i - run));
+    switch (c) {
+    case '"':
+      out.append("\\\"");
+      break;
+    case '\\':
+      out.append("\\\\");
+      break;
+    case '\n':
+      out.append("\\n");
+      break;
+    case '\t':
+      out.append("\\t");
+      break;
+    case '\r':
+      out.append("\\r");
+      break;
+    default:
+      const char escape[] = {'\\', 'u', '0', '0', Hex[c >> 4], Hex[c & 15]};
+      out.append({escape, sizeof(escape)});
+    }
+    run = i + 1;
+  }
+  out.append(text.substr(run));
+}
+
+template <typename T> void write(Buffer &out, const T &value) {
+  if constexpr (is_same_v<T, bool>) {
+    out.append(value ? "true" : "false");
+  } else if constexpr (Number<T>) {
+    char digits[64];
+    char *end = to_chars(digits, digits + sizeof(digits), value).ptr;
+    out.append({digits, size_t(end - digits)});
+  } else if constexpr (is_same_v<T, char>) {
+    out.put('\'');
+    writeEscaped(out, {&value, 1});
+    out.put('\'');
+  } else if constexpr (Text<T>) {
+    out.put('"');
+    writeEscaped(out, value);
+    out.put('"');
+  } else if constexpr (UserRecord<T>) {
+    out.append("User{id=");
+    write(out, int(value.getId()));
+    out.append(", name=");
+    write(out, string_view(value.getName()));
+    out.append(", age=");
+    write(out, int(value.getAge()));
+    out.put('}');
+  } else if constexpr (Sequence<T>) {
+    // The first element is peeled off so the loop needs no separator test
+    out.put('[');
+    auto it = begin(value);
+    auto last = end(value);
+    if (it != last) {
+      write(out, *it);
+      for (++it; it != last; ++it) {
+        out.append(", ");
+        write(out, *it);
+      }
+    }
+    out.put(']');
+  } else if constexpr (Streamable<T>) {
+    BufferStreambuf sink(out);
+    ostream stream(&sink);
+    stream << value;
+  } else {
+    static_assert(sizeof(T) == 0, "no serializer for this type");
+  }
+}
+
+// Binary fast path: trivially copyable elements go out in one memcpy
+template <typename T>
+  requires is_trivially_copyable_v<T>
+void writeRaw(Buffer &out, span<const T> items) {
+  const char *bytes = reinterpret_cast<const char *>(items.data());
+  out.append({bytes, items.size_bytes()});
+}
+
+// Renders into a stack buffer (one heap retry for long values) and hands
+// the stream a single block
+template <typename T> ostream &print(ostream &os, const T &value) {
+  char line[256];
+  Buffer buffer(line, sizeof(line));
+  write(buffer, value);
+  if (buffer.fits()) {
+    return os.write(line, buffer.size());
+  }
+  string longLine(buffer.size(), '\0');
+  Buffer retry(longLine.data(), longLine.size());
+  write(retry, value);
+  return os.write(longLine.data(), longLine.size());
+}
+
+} // namespace serial
+
+/**
+ * Formats "User{id=1, name=\"Alice\", age=28}" into `out` without
+ * allocating. Like snprintf, it returns the full length; the output is
+ * complete only when that is at most `capacity`. Works on User and
+ * table rows.
+ */
+template <typename U>
+size_t formatUser(char *out, size_t capacity, const U &user) {
+  serial::Buffer buffer(out, capacity);
+  serial::write(buffer, user);
+  return buffer.size();
+}
+
+ostream &operator<<(ostream &os, const User &user) {
+  return serial::print(os, user);
+}
+
+/**
+ * Collects formatted records in a reusable buffer and hands them to the
+ * stream in large blocks. Nothing is flushed per record.
+ */
+class BufferedUserWriter {
+private:
+  ostream &out;
+  vector<char> buffer;
+  size_t used = 0;
+
+public:
+  explicit BufferedUserWriter(ostream &out, size_t capacity = 64 * 1024)
+      : out(out), buffer(capacity) {}
+
+  BufferedUserWriter(const BufferedUserWriter &) = delete;
+  BufferedUserWriter &operator=(const BufferedUserWriter &) = delete;
+
+  ~BufferedUserWriter() { flush(); }
+
+  // Appends one record followed by a newline
+  template <typename U> void write(const U &user) {
+    size_t length = formatUser(buffer.data() + used, buffer.size() - used,
+                               user);
+    if (used + length + 1 > buffer.size()) {
+      flush();
+      if (length + 1 > buffer.size()) {
+        buffer.resize(length + 1);
+      }
+      length = formatUser(buffer.data(), buffer.size(), user);
+    }
+    used += length;
+    buffer[used++] = '\n';
+  }
+
+  void flush() {
+    if (used > 0) {
+      out.write(buffer.data(), used);
+      used = 0;
+    }
+  }
+};
+
+/**
+ * Dense slot storage: items sit in one array of {id, item} entries in id
+ * order, and a second array maps the ids of a window, `base` upwards, to
+ * their entries. Slots are not indexed by id - 1 and there is no free
+ * list: ids only ever grow, so an id a caller kept can never find another
+ * item. A removed item leaves an empty entry until empty ones outnumber
+ * live ones and the array is compacted.
+ *
+ * The window spans at most Spread ids per entry in it, plus Slack, so the
+ * map follows the item count rather than the largest id. Entries below
+ * the window, such as old survivors of heavy churn or a sparse restore,
+ * are found by binary search.
+ *
+ * New ids append in O(1). An older id put on its own is inserted in place
+ * in O(n); putSorted takes a batch of them in one merge.
+ */
+template <typename T> class DenseSlotStorage {
+private:
+  struct Entry {
+    int id;
+    shared_ptr<T> item; // null once removed
+  };
+
+  static constexpr size_t Spread = 4;
+  static constexpr size_t Slack = 64;
+
+  vector<Entry> entries;     // ascending ids
+  size_t head = 0;           // entries[0, head) lie below the window
+  int base = 1;              // first id of the window
+  vector<uint32_t> position; // id - base -> entry index + 1, 0 when absent
+  size_t rebasedAt = 0;      // entry count at the last rebase
+  size_t live = 0;
+  int nextId = 1;
+
+  static constexpr size_t npos = SIZE_MAX;
+
+  static bool idBelow(const Entry &entry, int id) { return entry.id < id; }
+
+  static bool dense(size_t span, size_t count) {
+    return span <= Spread * count + Slack;
+  }
+
+  // Widest window that stays dense, found in one pass; the map is rebuilt
+  void rebase() {
+    size_t n = entries.size();
+    head = 0;
+    while (head < n &&
+           !dense(size_t(entries.back().id - entries[head].id) + 1, n - head)) {
+      ++head;
+    }
+    base = head < n ? entries[head].id : nextId;
+    position.assign(head < n ? size_t(entries.back().id - base) + 1 : 0, 0);
+    reindexFrom(head);
+    rebasedAt = n;
+  }
+
+  void compact() {
+    erase_if(entries, [](const Entry &entry) { return !entry.item; });
+    rebase();
+  }
+
+  void reindexFrom(size_t first) {
+    for (size_t i = max(first, head); i < entries.size(); ++i) {
+      if (entries[i].item) {
+        position[entries[i].id - base] = static_cast<uint32_t>(i + 1);
+      }
+    }
+  }
+
+  // Index of the live entry holding `id`, or npos
+  size_t indexOf(int id) const {
+    if (id >= base) {
+      size_t at = size_t(id - base);
+      return at < position.size() && position[at] != 0 ? position[at] - 1
+                                                        : npos;
+    }
+    auto end = entries.begin() + head;
+    auto it = lower_bound(entries.begin(), end, id, idBelow);
+    return it != end && it->id == id && it->item
+               ? size_t(it - entries.begin())
+               : npos;
+  }
+
+public:
+  int allocateId() { return allocateRange(1); }
+
+  // Reserve `n` consecutive fresh ids and return the first one
+  int allocateRange(size_t n) {
+    if (n > size_t(INT_MAX - nextId)) {
+      throw overflow_error("Repository ran out of ids");
+    }
+    int first = nextId;
+    nextId += static_cast<int>(n);
+    return first;
+  }
+
+  // Take a specific id out of circulation, e.g. when restoring
+  void claim(int id) {
+    if (id >= INT_MAX) {
+      throw overflow_error("Repository ran out of ids");
+    }
+    nextId = max(nextId, id + 1);
+  }
+
+  int upcomingId() const { return nextId; }
+
+  void reserve(size_t n) {
+    entries.reserve(n);
+    position.reserve(position.size() + (n > live ? n - live : 0));
+  }
+
+  void shrinkToFit() {
+    compact();
+    entries.shrink_to_fit();
+    position.shrink_to_fit();
+  }
+
+  // Ids above the last one append in O(1), which is how new items and a
+  // restore in id order arrive. An older id is inserted in place and
+  // renumbers the entries after it, so it costs O(n); use putSorted for
+  // more than a few.
+  void put(int id, shared_ptr<T> item) {
+    if (!entries.empty() && id <= entries.back().id) {
+      auto it = lower_bound(entries.begin(), entries.end(), id, idBelow);
+      size_t at = size_t(it - entries.begin());
+      if (it->id == id) {
+        live += !it->item;
+        it->item = std::move(item);
+        if (id >= base) {
+          position[id - base] = static_cast<uint32_t>(at + 1);
+        }
+        return;
+      }
+      ++live;
+      entries.insert(it, {id, std::move(item)});
+      if (id < base) {
+        ++head;
+      }
+      reindexFrom(at);
+      return;
+    }
+
+    ++live;
+    entries.push_back({id, std::move(item)});
+    size_t window = entries.size() - head;
+    if (window > 1 && dense(size_t(id - base) + 1, window)) {
+      position.resize(size_t(id - base) + 1);
+      position.back() = static_cast<uint32_t>(entries.size());
+    } else if (window > 1 && entries.size() >= 2 * rebasedAt) {
+      rebase(); // amortized by the doubling
+    } else {
+      // Too far past the window: start a new one at this id
+      head = entries.size() - 1;
+      base = id;
+      position.assign(1, static_cast<uint32_t>(entries.size()));
+    }
+  }
+
+  /**
+   * Stores a batch with distinct ids in ascending order. Ids already
+   * present are replaced in place and ids above the last one append as in
+   * put. New older ids are appended and merged into place together, with
+   * one rebase, so the batch costs O(n + k) rather than O(n) per id.
+   */
+  void putSorted(span<pair<int, shared_ptr<T>>> items) {
+    int last = entries.empty() ? 0 : entries.back().id;
+    auto above = partition_point(items.begin(), items.end(),
+                                 [&](const auto &item) {
+                                   return item.first <= last;
+                                 });
+    size_t appended = entries.size();
+    for (auto it = items.begin(); it != above; ++it) {
+      auto &[id, item] = *it;
+      auto found = lower_bound(entries.begin(), entries.begin() + appended,
+                               id, idBelow);
+      if (found->id == id) {
+        live += !found->item;
+        found->item = std::move(item);
+        if (id >= base) {
+          position[id - base] =
+              static_cast<uint32_t>(found - entries.begin() + 1);
+        }
+      } else {
+        ++live;
+        entries.push_back({id, std::move(item)});
+      }
+    }
+    if (entries.size() > appended) {
+      inplace_merge(entries.begin(), entries.begin() + appended,
+                    entries.end(), [](const Entry &a, const Entry &b) {
+                      return a.id < b.id;
+                    });
+      rebase();
+    }
+    for (auto it = above; it != items.end(); ++it) {
+      put(it->first, std::move(it->second));
+    }
+  }
+
+  const shared_ptr<T> *get(int id) const {
+    size_t at = indexOf(id);
+    return at != npos ? &entries[at].item : nullptr;
+  }
+
+  bool erase(int id) {
+    size_t at = indexOf(id);
+    if (at == npos) {
+      return false;
+    }
+    entries[at].item.reset();
+    if (id >= base) {
+      position[id - base] = 0;
+    }
+    --live;
+    if (entries.size() - live > live) {
+      compact();
+    }
+    return true;
+  }
+
+  template <typename F> void forEach(F &&fn) const {
+    for (const Entry &entry : entries) {
+      if (entry.item) {
+        fn(entry.id, entry.item);
+      }
+    }
+  }
+
+  // Visits up to `limit` live ids above `afterId` in ascending order:
+  // a binary search for the start, then the page and any empty entries
+  // inside it
+  template <typename F> void scan(int afterId, size_t limit, F &&fn) const {
+    auto it = partition_point(
+        entries.begin(), entries.end(),
+        [&](const Entry &entry) { return entry.id <= afterId; });
+    for (; it != entries.end() && limit > 0; ++it) {
+      if (it->item) {
+        fn(it->id, it->item);
+        --limit;
+      }
+    }
+  }
+
+  size_t size() const { return live; }
+};
+
+/**
+ * Open-addressing hash storage with linear probing.
+ * Erase uses backward-shift deletion, so the table never holds tombstones.
+ * Scans go through a side list of ids in ascending order; erased ids stay
+ * in it until they make up half of it.
+ */
+template <typename T> class FlatHashStorage {
+private:
+  struct Entry {
+    int id = 0; // 0 marks an empty bucket
+    shared_ptr<T> item;
+  };
+
+  vector<Entry> buckets = vector<Entry>(16);
+  size_t live = 0;
+  int nextId = 1;
+  vector<int> order; // ascending ids, erased ones included
+  size_t erased = 0; // erased ids still in `order`
+
+  // New ids arrive in order; an older one (a restore, or a concurrent
+  // save that took its lock late) is inserted near the end
+  void addToOrder(int id) {
+    if (order.empty() || order.back() < id) {
+      order.push_back(id);
+      return;
+    }
+    auto it = lower_bound(order.begin(), order.end(), id);
+    if (it != order.end() && *it == id) {
+      --erased;
+    } else {
+      order.insert(it, id);
+    }
+  }
+
+  void compactOrder() {
+    erase_if(order, [&](int id) { return get(id) == nullptr; });
+    erased = 0;
+  }
+
+  size_t mask() const { return buckets.size() - 1; }
+
+  // Fibonacci hashing spreads sequential ids across the table
+  size_t home(int id) const {
+    return (static_cast<uint64_t>(id) * 11400714819323198485ull) >>
+           (64 - __builtin_ctzll(buckets.size()));
+  }
+
+  void rehash(size_t size) {
+    vector<Entry> old(size);
+    old.swap(buckets);
+    for (auto &entry : old) {
+      if (entry.id != 0) {
+        size_t i = home(entry.id);
+        while (buckets[i].id != 0) {
+          i = (i + 1) & mask();
+        }
+        buckets[i] = std::move(entry);
+      }
+    }
+  }
+
+  size_t probe(int id) const {
+    size_t i = home(id);
+    while (buckets[i].id != 0 && buckets[i].id != id) {
+      i = (i + 1) & mask();
+    }
+    return i;
+  }
+
+public:
+  int allocateId() { return allocateRange(1); }
+
+  int allocateRange(size_t n) {
+    if (n > size_t(INT_MAX - nextId)) {
+      throw overflow_error("Repository ran out of ids");
+    }
+    int first = nextId;
+    nextId += static_cast<int>(n);
+    return first;
+  }
+
+  void claim(int id) {
+    if (id >= INT_MAX) {
+      throw overflow_error("Repository ran out of ids");
+    }
+    nextId = max(nextId, id + 1);
+  }
+
+  int upcomingId() const { return nextId; }
+
+  // Size the table for `n` entries so bulk inserts rehash at most once
+  void reserve(size_t n) {
+    size_t size = buckets.size();
+    while (n * 10 > size * 7) {
+      size *= 2;
+    }
+    if (size != buckets.size()) {
+      rehash(size);
+    }
+    order.reserve(n + erased);
+  }
+
+  // Smallest table that holds the live entries under the load limit
+  void shrinkToFit() {
+    compactOrder();
+    order.shrink_to_fit();
+    size_t size = 16;
+    while (live * 10 > size * 7) {
+      size *= 2;
+    }
+    if (size != buckets.size()) {
+      rehash(size);
+    }
+  }
+
+  void put(int id, shared_ptr<T> item) {
+    if ((live + 1) * 10 > buckets.size() * 7) {
+      rehash(buckets.size() * 2);
+    }
+    size_t i = probe(id);
+    if (buckets[i].id == 0) {
+      buckets[i].id = id;
+      ++live;
+      addToOrder(id);
+    }
+    buckets[i].item = std::move(item);
+  }
+
+  const shared_ptr<T> *get(int id) const {
+    if (id < 1) {
+      return nullptr;
+    }
+    size_t i = probe(id);
+    return buckets[i].id == id ? &buckets[i].item : nullptr;
+  }
+
+  bool erase(int id) {
+    if (id < 1) {
+      return false;
+    }
+    size_t hole = probe(id);
+    if (buckets[hole].id != id) {
+      return false;
+    }
+
+    // Pull back any entry whose probe sequence crosses the hole
+    for (size_t i = (hole + 1) & mask(); buckets[i].id != 0;
+         i = (i + 1) & mask()) {
+      size_t want = home(buckets[i].id);
+      if (((i - want) & mask()) >= ((i - hole) & mask())) {
+        buckets[hole] = std::move(buckets[i]);
+        hole = i;
+      }
+    }
+    buckets[hole] = Entry{};
+    --live;
+    if (++erased > order.size() / 2) {
+      compactOrder();
+    }
+    return true;
+  }
+
+  template <typename F> void forEach(F &&fn) const {
+    for (const auto &entry : buckets) {
+      if (entry.id != 0) {
+        fn(entry.id, entry.item);
+      }
+    }
+  }
+
+  // A binary search for the start, then one probe per listed id until
+  // `limit` live items are found
+  template <typename F> void scan(int afterId, size_t limit, F &&fn) const {
+    auto it = upper_bound(order.begin(), order.end(), afterId);
+    for (; it != order.end() && limit > 0; ++it) {
+      if (auto item = get(*it)) {
+        fn(*it, *item);
+        --limit;
+      }
+    }
+  }
+
+  size_t size() const { return live; }
+};
+
+/**
+ * Generic repository template class
+ */
+template <typename T, typename Storage = DenseSlotStorage<T>>
+class Repository {
+private:
+  Storage storage;
+
+public:
+  // Add item to repository. Moving the pointer in costs one refcount
+  // increment, for the stored copy; the caller's reference is returned.
+  shared_ptr<T> save(shared_ptr<T> &&item) {
+    int id = storage.allocateId();
+    if constexpr (requires { item->setId(id); }) {
+      item->setId(id);
+    }
+    storage.put(id, item);
+    return std::move(item);
+  }
+
+  shared_ptr<T> save(const shared_ptr<T> &item) {
+    return save(shared_ptr<T>(item));
+  }
+
+  // Save many items under one contiguous id range; returns the first id
+  int saveBatch(span<const shared_ptr<T>> items) {
+    storage.reserve(storage.size() + items.size());
+    int first = storage.allocateRange(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+      int id = first + static_cast<int>(i);
+      if constexpr (requires { items[i]->setId(id); }) {
+        items[i]->setId(id);
+      }
+      storage.put(id, items[i]);
+    }
+    return first;
+  }
+
+  // The id the next save gets; ids below it are never handed out again
+  int upcomingId() const { return storage.upcomingId(); }
+
+  // Keep ids up to `id` from being handed out, e.g. those of items
+  // removed before a snapshot was taken
+  void claim(int id) { storage.claim(id); }
+
+  // Store an item under an id chosen by the caller, e.g. when restoring.
+  // Ids should come in ascending order; see DenseSlotStorage::put.
+  void saveAs(int id, shared_ptr<T> item) {
+    storage.claim(id);
+    if constexpr (requires { item->setId(id); }) {
+      item->setId(id);
+    }
+    storage.put(id, std::move(item));
+  }
+
+  // saveAs for a batch with distinct ids in any order: sorted once, then
+  // handed over whole to storages that can merge it
+  void saveAllAs(vector<pair<int, shared_ptr<T>>> items) {
+    if (items.empty()) {
+      return;
+    }
+    sort(items.begin(), items.end(), [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    });
+    storage.claim(items.back().first);
+    for (auto &[id, item] : items) {
+      if constexpr (requires { item->setId(id); }) {
+        item->setId(id);
+      }
+    }
+    if constexpr (requires { storage.putSorted(span(items)); }) {
+      storage.putSorted(span(items));
+    } else {
+      for (auto &[id, item] : items) {
+        storage.put(id, std::move(item));
+      }
+    }
+  }
+
+  // Find by ID
+  optional<shared_ptr<T>> findById(int id) const {
+    if (auto item = storage.get(id)) {
+      return *item;
+    }
+    return nullopt;
+  }
+
+  /**
+   * Lookup without refcount traffic. The pointer is borrowed: it is valid
+   * until the item is removed, and the caller must not keep it past that.
+   */
+  T *findBorrowed(int id) const {
+    auto item = storage.get(id);
+    return item ? item->get() : nullptr;
+  }
+
+  // Get all items
+  vector<shared_ptr<T>> findAll() const {
+    vector<shared_ptr<T>> result;
+    result.reserve(storage.size());
+    storage.forEach(
+        [&](int, const shared_ptr<T> &item) { result.push_back(item); });
+    return result;
+  }
+
+  // Visit every item in place; no copies and no refcount traffic
+  template <typename F> void forEach(F &&fn) const {
+    storage.forEach([&](int, const shared_ptr<T> &item) { fn(*item); });
+  }
+
+  // Visit items matching a predicate, handing out the owning pointer
+  template <typename Pred, typename F>
+  void forEachWhere(Pred &&pred, F &&fn) const {
+    storage.forEach([&](int, const shared_ptr<T> &item) {
+      if (pred(*item)) {
+        fn(item);
+      }
+    });
+  }
+
+  /**
+   * One page of items with ids above `afterId`, in id order. Feed the
+   * last id of a page back in to resume; an empty page ends the scan.
+   * Ids only grow, so items added during a scan land above the cursor
+   * and show up in a later page; removed ones simply drop out.
+   */
+  vector<shared_ptr<T>> scan(int afterId, size_t limit) const {
+    vector<shared_ptr<T>> page;
+    page.reserve(min(limit, storage.size()));
+    storage.scan(afterId, limit, [&](int, const shared_ptr<T> &item) {
+      page.push_back(item);
+    });
+    return page;
+  }
+
+  void reserve(size_t n) { storage.reserve(n); }
+  void shrinkToFit() { storage.shrinkToFit(); }
+
+  // Remove by ID
+  bool remove(int id) { return storage.erase(id); }
+
+  // Get count
+  size_t count() const { return storage.size(); }
+};
+
+/**
+ * shared_mutex where a waiting writer holds back new readers, so a
+ * steady stream of lookups cannot starve save/remove
+ */
+class WriterPriorityMutex {
+private:
+  shared_mutex mutex;
+  atomic<int> waitingWriters{0};
+
+public:
+  void lock() {
+    waitingWriters.fetch_add(1, memory_order_acquire);
+    mutex.lock();
+    waitingWriters.fetch_sub(1, memory_order_release);
+  }
+
+  void unlock() { mutex.unlock(); }
+
+  void lock_shared() {
+    while (waitingWriters.load(memory_order_acquire) > 0) {
+      this_thread::yield();
+    }
+    mutex.lock_shared();
+  }
+
+  void unlock_shared() { mutex.unlock_shared(); }
+};
+
+/**
+ * Epoch-based reclamation. Readers pin the current epoch for the
+ * lifetime of an EpochGuard; a retired object is freed only once no
+ * reader is still pinned at or before the epoch it was retired in.
+ * There is one domain, global(): a thread's record is cached in a
+ * thread_local that does not know which domain it came from.
+ */
+class EpochDomain {
+private:
+  struct Record {
+    atomic<uint64_t> epoch{0}; // 0 while the thread holds no guard
+    atomic<bool> inUse{false};
+    Record *next = nullptr;
+    int depth = 0; // guard nesting, touched only by the owning thread
+  };
+
+  struct Retired {
+    uint64_t epoch;
+    shared_ptr<void> object;
+  };
+
+  // Hands the record back for reuse when its thread exits
+  struct ThreadSlot {
+    Record *record = nullptr;
+    ~ThreadSlot() {
+      if (record != nullptr) {
+        record->inUse.store(false, memory_order_release);
+      }
+    }
+  };
+
+  static constexpr size_t CollectBatch = 64;
+
+  atomic<uint64_t> globalEpoch{1};
+  atomic<Record *> records{nullptr};
+  mutex retireLock;
+  vector<Retired> retired;
+  // A collection walks every thread record, so when pinned readers keep
+  // objects alive the next one waits for the list to double
+  size_t collectAt = CollectBatch;
+
+  Record *acquireRecord() {
+    for (Record *r = records.load(memory_order_acquire); r; r = r->next) {
+      bool expected = false;
+      if (r->inUse.compare_exchange_strong(expected, true)) {
+        return r;
+      }
+    }
+    auto *record = new Record;
+    record->inUse.store(true, memory_order_relaxed);
+    Record *head = records.load(memory_order_relaxed);
+    do {
+      record->next = head;
+    } while (!records.compare_exchange_weak(head, record,
+                                            memory_order_release,
+                                            memory_order_relaxed));
+    return record;
+  }
+
+  Record &local() {
+    thread_local ThreadSlot slot;
+    if (slot.record == nullptr) {
+      slot.record = acquireRecord();
+    }
+    return *slot.record;
+  }
+
+  uint64_t oldestPinned() const {
+    uint64_t oldest = UINT64_MAX;
+    for (Record *r = records.load(memory_order_acquire); r; r = r->next) {
+      uint64_t epoch = r->epoch.load(memory_order_acquire);
+      if (epoch != 0) {
+        oldest = min(oldest, epoch);
+      }
+    }
+    return oldest;
+  }
+
+  // Caller holds retireLock
+  void collectLocked() {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t oldest = oldestPinned();
+    erase_if(retired, [&](const Retired &r) { return r.epoch < oldest; });
+    collectAt = max(CollectBatch, 2 * retired.size());
+  }
+
+  // Retired users hand their strings back when freed, the global domain's
+  // at exit included; building the store first makes it outlive the domain
+  EpochDomain() { StringStore::instance(); }
+
+public:
+  EpochDomain(const EpochDomain &) = delete;
+  EpochDomain &operator=(const EpochDomain &) = delete;
+
+  ~EpochDomain() {
+    for (Record *r = records.load(); r != nullptr;) {
+      Record *next = r->next;
+      delete r;
+      r = next;
+    }
+  }
+
+  static EpochDomain &global() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  void enter() {
+    Record &record = local();
+    if (record.depth++ == 0) {
+      record.epoch.store(globalEpoch.load(memory_order_acquire),
+                         memory_order_relaxed);
+      // Publish the pin before any protected pointer is loaded
+      atomic_thread_fence(memory_order_seq_cst);
+    }
+  }
+
+  void exit() {
+    Record &record = local();
+    if (--record.depth == 0) {
+      record.epoch.store(0, memory_order_release);
+    }
+  }
+
+  // `object` must already be unreachable for new readers
+  void retire(shared_ptr<void> object) {
+    lock_guard guard(retireLock);
+    retired.push_back(
+        {globalEpoch.fetch_add(1, memory_order_acq_rel), std::move(object)});
+    if (retired.size() >= collectAt) {
+      collectLocked();
+    }
+  }
+
+  void collect() {
+    lock_guard guard(retireLock);
+    collectLocked();
+  }
+};
+
+/**
+ * Pins the calling thread's epoch; pointers borrowed under the guard stay
+ * valid until it is destroyed
+ */
+class EpochGuard {
+public:
+  EpochGuard() { EpochDomain::global().enter(); }
+  ~EpochGuard() { EpochDomain::global().exit(); }
+
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+};
+
+/**
+ * NUMA topology as the kernel reports it under /sys/devices/system/node.
+ * Placement relies on first touch: a page lands on the node of the thread
+ * that first writes it, so allocating from a pinned thread is enough.
+ * Without sysfs (or off Linux) the machine is treated as one node.
+ */
+namespace numa {
+
+struct Node {
+  int id = 0;
+  vector<int> cpus;
+};
+
+// Parses the kernel's list format, e.g. "0-3,8-11"
+inline vector<int> parseList(string_view text) {
+  vector<int> values;
+  while (!text.empty()) {
+    size_t comma = text.find(',');
+    string_view item = text.substr(0, comma);
+    text = comma == string_view::npos ? string_view() : text.substr(comma + 1);
+    const char *end = item.data() + item.size();
+    int first = 0;
+    auto parsed = from_chars(item.data(), end, first);
+    if (parsed.ec != errc()) {
+      continue;
+    }
+    int last = first;
+    if (parsed.ptr != end && *parsed.ptr == '-') {
+      from_chars(parsed.ptr + 1, end, last);
+    }
+    for (int value = first; value <= last; ++value) {
+      values.push_back(value);
+    }
+  }
+  return values;
+}
+
+inline string readSysfs(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return {};
+  }
+  char buffer[4096];
+  ssize_t size = ::read(fd, buffer, sizeof(buffer));
+  ::close(fd);
+  return size > 0 ? string(buffer, size) : string();
+}
+
+// Memory-only nodes have no CPUs to run on and are left out
+inline vector<Node> discover() {
+  const string root = "/sys/devices/system/node/";
+  vector<Node> nodes;
+  for (int id : parseList(readSysfs(root + "online"))) {
+    Node node{id, parseList(readSysfs(root + "node" + to_string(id) +
+                                      "/cpulist"))};
+    if (!node.cpus.empty()) {
+      nodes.push_back(std::move(node));
+    }
+  }
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    nodes.back().cpus.resize(max(1u, thread::hardware_concurrency()));
+    iota(nodes.back().cpus.begin(), nodes.back().cpus.end(), 0);
+  }
+  return nodes;
+}
+
+inline const vector<Node> &topology() {
+  static const vector<Node> nodes = discover();
+  return nodes;
+}
+
+// Restricts the calling thread to the node's CPUs; false if unsupported
+inline bool pin(const Node &node) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : node.cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)node;
+  return false;
+#endif
+}
+
+// Runs fn to completion on a thread pinned to `node`
+template <typename F> void runOn(const Node &node, F &&fn) {
+  exception_ptr error;
+  thread worker([&] {
+    pin(node);
+    try {
+      fn();
+    } catch (...) {
+      error = current_exception();
+    }
+  });
+  worker.join();
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+/**
+ * Memory for the objects kept on one node. Blocks are bump-allocated
+ * from 1 MiB slabs, and freed blocks are kept per size for reuse.
+ * reserve() writes every page of the slabs it adds, so calling it on a
+ * thread pinned to the node places them there; slabs added later land
+ * wherever the allocating thread runs.
+ */
+class Arena {
+private:
+  static constexpr size_t SlabSize = size_t(1) << 20;
+  static constexpr size_t Align = alignof(max_align_t);
+
+  mutex lock;
+  vector<unique_ptr<char[]>> slabs;
+  size_t nextSlab = 0;
+  char *cursor = nullptr;
+  size_t left = 0;
+  unordered_map<size_t, vector<void *>> freed;
+
+  static size_t rounded(size_t size) {
+    return (size + Align - 1) / Align * Align;
+  }
+
+public:
+  void reserve(size_t bytes) {
+    lock_guard guard(lock);
+    size_t want = nextSlab + (bytes + SlabSize - 1) / SlabSize;
+    while (slabs.size() < want) {
+      slabs.emplace_back(new char[SlabSize]);
+      memset(slabs.back().get(), 0, SlabSize);
+    }
+  }
+
+  void *allocate(size_t size) {
+    size = rounded(size);
+    if (size > SlabSize) {
+      throw bad_alloc();
+    }
+    lock_guard guard(lock);
+    if (auto it = freed.find(size); it != freed.end() && !it->second.empty()) {
+      void *block = it->second.back();
+      it->second.pop_back();
+      return block;
+    }
+    if (left < size) {
+      if (nextSlab == slabs.size()) {
+        slabs.emplace_back(new char[SlabSize]);
+      }
+      cursor = slabs[nextSlab++].get();
+      left = SlabSize;
+    }
+    void *block = cursor;
+    cursor += size;
+    left -= size;
+    return block;
+  }
+
+  void deallocate(void *block, size_t size) {
+    lock_guard guard(lock);
+    freed[rounded(size)].push_back(block);
+  }
+};
+
+// Allocator over a shared Arena. Objects made with allocate_shared keep
+// a copy, so the arena outlives the last of them.
+template <typename T> struct ArenaAllocator {
+  using value_type = T;
+
+  shared_ptr<Arena> arena;
+
+  explicit ArenaAllocator(shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->allocate(n * sizeof(T)));
+  }
+  void deallocate(T *block, size_t n) {
+    arena->deallocate(block, n * sizeof(T));
+  }
+
+  template <typename U> bool operator==(const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+};
+
+} // namespace numa
+
+/**
+ * Lock-striped repository: id N lives in shard N % Shards, and each
+ * shard has its own lock. Ids come from an atomic counter.
+ *
+ * Next to the owning storage, each shard publishes raw pointers in a
+ * chunked slot directory so findBorrowed can read without locks or
+ * refcount bumps. Removed items and outgrown directories are retired
+ * through the EpochDomain.
+ */
+template <typename T, size_t Shards = 16,
+          typename Storage = FlatHashStorage<T>>
+class ShardedRepository {
+private:
+  static constexpr size_t ChunkBits = 10;
+  static constexpr size_t ChunkMask = (size_t(1) << ChunkBits) - 1;
+
+  struct Chunk {
+    array<atomic<T *>, size_t(1) << ChunkBits> slots{};
+  };
+
+  struct Directory {
+    vector<atomic<Chunk *>> chunks;
+    explicit Directory(size_t size) : chunks(size) {}
+  };
+
+  // Padded to a cache line so neighbouring shard locks don't false-share
+  struct alignas(64) Shard {
+    mutable WriterPriorityMutex lock;
+    Storage storage;
+    vector<unique_ptr<Chunk>> chunks;
+    shared_ptr<Directory> directory;
+    atomic<Directory *> published{nullptr};
+  };
+
+  array<Shard, Shards> shards;
+  atomic<int> nextId{1};
+  size_t placedNodes = 1; // shard s lives on node s % placedNodes
+
+  // Every id up to publishedThrough is stored or was given up. Ids finish
+  // out of order, so the ones past it wait in a min-heap until the ids
+  // before them are done.
+  atomic<int> publishedThrough{0};
+  mutex publishLock;
+  vector<int> finishedAhead;
+
+  // Runs once the save of `id` committed or failed, after the shard lock
+  struct Finish {
+    ShardedRepository *repository;
+    int id;
+    ~Finish() { repository->finish(id); }
+  };
+
+  Shard &shardFor(int id) { return shards[size_t(id) % Shards]; }
+  const Shard &shardFor(int id) const { return shards[size_t(id) % Shards]; }
+
+  // A compare-and-swap rather than fetch_add, so a full counter stays
+  // at INT_MAX instead of wrapping to ids already handed out
+  int allocateId() {
+    int id = nextId.load(memory_order_relaxed);
+    do {
+      if (id == INT_MAX) {
+        throw overflow_error("Repository ran out of ids");
+      }
+    } while (!nextId.compare_exchange_weak(id, id + 1, memory_order_relaxed));
+    return id;
+  }
+
+  void finish(int id) {
+    lock_guard guard(publishLock);
+    int through = publishedThrough.load(memory_order_relaxed);
+    if (id != through + 1) {
+      finishedAhead.push_back(id);
+      push_heap(finishedAhead.begin(), finishedAhead.end(), greater<>());
+      return;
+    }
+    ++through;
+    while (!finishedAhead.empty() && finishedAhead.front() == through + 1) {
+      pop_heap(finishedAhead.begin(), finishedAhead.end(), greater<>());
+      finishedAhead.pop_back();
+      ++through;
+    }
+    publishedThrough.store(through, memory_order_release);
+  }
+
+  // Caller holds the shard's write lock
+  atomic<T *> &slotFor(Shard &shard, int id) {
+    size_t index = size_t(id) / Shards;
+    size_t chunk = index >> ChunkBits;
+    size_t size = shard.directory ? shard.directory->chunks.size() : 0;
+
+    if (chunk >= size) {
+      auto grown = make_shared<Directory>(max(chunk + 1, size * 2));
+      for (size_t i = 0; i < size; ++i) {
+        grown->chunks[i].store(
+            shard.directory->chunks[i].load(memory_order_relaxed),
+            memory_order_relaxed);
+      }
+      shard.published.store(grown.get(), memory_order_release);
+      if (shard.directory) {
+        EpochDomain::global().retire(std::move(shard.directory));
+      }
+      shard.directory = std::move(grown);
+    }
+
+    auto &entry = shard.directory->chunks[chunk];
+    if (entry.load(memory_order_relaxed) == nullptr) {
+      shard.chunks.push_back(make_unique<Chunk>());
+      entry.store(shard.chunks.back().get(), memory_order_release);
+    }
+    return entry.load(memory_order_relaxed)->slots[index & ChunkMask];
+  }
+
+public:
+  shared_ptr<T> save(shared_ptr<T> &&item) {
+    int id = allocateId();
+    Finish finished{this, id};
+    if constexpr (requires { item->setId(id); }) {
+      item->setId(id);
+    }
+    Shard &shard = shardFor(id);
+    unique_lock guard(shard.lock);
+    shard.storage.put(id, item);
+    slotFor(shard, id).store(item.get(), memory_order_release);
+    return std::move(item);
+  }
+
+  shared_ptr<T> save(const shared_ptr<T> &item) {
+    return save(shared_ptr<T>(item));
+  }
+
+  // Like save, for items built once their id is known, so make(id) can
+  // allocate on nodeOfId(id)
+  template <typename Make> shared_ptr<T> create(Make &&make) {
+    int id = allocateId();
+    Finish finished{this, id};
+    shared_ptr<T> item = make(id);
+    Shard &shard = shardFor(id);
+    unique_lock guard(shard.lock);
+    shard.storage.put(id, item);
+    slotFor(shard, id).store(item.get(), memory_order_release);
+    return item;
+  }
+
+  // Lock-free lookup; the pointer is valid while `guard` is alive
+  const T *findBorrowed(int id, const EpochGuard &guard) const {
+    (void)guard;
+    if (id < 1) {
+      return nullptr;
+    }
+    const Shard &shard = shardFor(id);
+    Directory *directory = shard.published.load(memory_order_acquire);
+    size_t index = size_t(id) / Shards;
+    size_t chunk = index >> ChunkBits;
+    if (directory == nullptr || chunk >= directory->chunks.size()) {
+      return nullptr;
+    }
+    Chunk *slots = directory->chunks[chunk].load(memory_order_acquire);
+    if (slots == nullptr) {
+      return nullptr;
+    }
+    return slots->slots[index & ChunkMask].load(memory_order_acquire);
+  }
+
+  optional<shared_ptr<T>> findById(int id) const {
+    const Shard &shard = shardFor(id);
+    shared_lock guard(shard.lock);
+    if (auto item = shard.storage.get(id)) {
+      return *item;
+    }
+    return nullopt;
+  }
+
+  // Each shard is visited under its own read lock; `fn` must not call
+  // back into the repository
+  template <typename F> void forEach(F &&fn) const {
+    for (const Shard &shard : shards) {
+      shared_lock guard(shard.lock);
+      shard.storage.forEach([&](int, const shared_ptr<T> &item) { fn(*item); });
+    }
+  }
+
+  template <typename Pred, typename F>
+  void forEachWhere(Pred &&pred, F &&fn) const {
+    for (size_t shard = 0; shard < Shards; ++shard) {
+      forEachWhereIn(shard, pred, fn);
+    }
+  }
+
+  // One shard's share of forEachWhere, for scans split up by node
+  template <typename Pred, typename F>
+  void forEachWhereIn(size_t index, Pred &&pred, F &&fn) const {
+    const Shard &shard = shards[index];
+    shared_lock guard(shard.lock);
+    shard.storage.forEach([&](int, const shared_ptr<T> &item) {
+      if (pred(*item)) {
+        fn(item);
+      }
+    });
+  }
+
+  /**
+   * Deals the shards out round-robin over `topology` and allocates each
+   * one's storage and slot chunks for `expected` items from a thread
+   * pinned to its node. Both are written as they are allocated: the
+   * default FlatHashStorage reserves by rehashing into a value-initialized
+   * bucket array and chunks start zeroed, so first touch happens on the
+   * pinned thread.
+   * Call before the repository is shared; growth past `expected` lands
+   * on whichever node the growing writer runs on.
+   */
+  void place(const vector<numa::Node> &topology, size_t expected) {
+    placedNodes = max<size_t>(topology.size(), 1);
+    size_t perShard = expected / Shards + 1;
+    size_t chunks = (perShard + ChunkMask) >> ChunkBits;
+    for (size_t node = 0; node < topology.size(); ++node) {
+      numa::runOn(topology[node], [&] {
+        for (size_t index = node; index < Shards; index += placedNodes) {
+          Shard &shard = shards[index];
+          unique_lock guard(shard.lock);
+          shard.storage.reserve(perShard);
+          for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            slotFor(shard, static_cast<int>((chunk << ChunkBits) * Shards +
+                                            index));
+          }
+        }
+      });
+    }
+  }
+
+  static constexpr size_t shardCount() { return Shards; }
+  size_t nodeOf(size_t shard) const { return shard % placedNodes; }
+  size_t nodeOfId(int id) const { return nodeOf(size_t(id) % Shards); }
+
+  vector<shared_ptr<T>> findAll() const {
+    vector<shared_ptr<T>> result;
+    forEachWhere([](const T &) { return true; },
+                 [&](const shared_ptr<T> &item) { result.push_back(item); });
+    return result;
+  }
+
+  vector<shared_ptr<T>> scan(int afterId, size_t limit) const {
+    return scan(afterId, limit, [](auto &&visit) {
+      for (size_t shard = 0; shard < Shards; ++shard) {
+        visit(shard);
+      }
+    });
+  }
+
+  /**
+   * Same contract as Repository::scan, at about O(limit) a page whatever
+   * the id span. Every shard hands over a quota from its storage's
+   * ordered scan; ids up to the lowest last id among shards that filled
+   * their quota are then complete, and a short round goes on from there
+   * with twice the quota. eachShard(visit) calls visit(i) once for every
+   * shard index, in any order and possibly in parallel.
+   * Each shard is read under its own read lock, so writers are never held
+   * up for a whole page. A page stops at publishedThrough: an id is
+   * allocated before its shard lock is taken, so a later id may already
+   * be stored while it is in flight. Ids past the mark wait for a later
+   * page rather than move the cursor over the one still being saved.
+   */
+  template <typename EachShard>
+  vector<shared_ptr<T>> scan(int afterId, size_t limit,
+                             EachShard &&eachShard) const {
+    using Found = pair<int, shared_ptr<T>>;
+    vector<shared_ptr<T>> page;
+    int cursor = max(afterId, 0);
+    int bound = publishedThrough.load(memory_order_acquire);
+    size_t quota = limit / Shards + 1;
+    while (page.size() < limit && cursor < bound) {
+      array<vector<Found>, Shards> parts;
+      eachShard([&](size_t index) {
+        const Shard &shard = shards[index];
+        shared_lock guard(shard.lock);
+        // Ids come in ascending order; one past `bound` leaves the part
+        // short, which reads as the shard running out
+        shard.storage.scan(cursor, quota,
+                           [&](int id, const shared_ptr<T> &item) {
+                             if (id <= bound) {
+                               parts[index].emplace_back(id, item);
+                             }
+                           });
+      });
+
+      int complete = INT_MAX;
+      vector<Found> round;
+      for (auto &part : parts) {
+        if (part.size() == quota) {
+          complete = min(complete, part.back().first);
+        }
+        round.insert(round.end(), make_move_iterator(part.begin()),
+                     make_move_iterator(part.end()));
+      }
+      sort(round.begin(), round.end(), [](const Found &a, const Found &b) {
+        return a.first < b.first;
+      });
+      for (auto &[id, item] : round) {
+        if (id > complete || page.size() == limit) {
+          break;
+        }
+        page.push_back(std::move(item));
+      }
+      if (complete == INT_MAX) {
+        break; // every shard ran out
+      }
+      cursor = complete;
+      quota *= 2;
+    }
+    return page;
+  }
+
+  /**
+   * Swaps the item under `id` for make(current) while holding the shard's
+   * write lock, so updates of one id serialize. The old item is retired
+   * through the EpochDomain like a removed one, so borrowed readers can
+   * finish with it. Returns the new item, or null when `id` is absent.
+   */
+  template <typename F> shared_ptr<T> update(int id, F &&make) {
+    shared_ptr<T> replaced;
+    shared_ptr<T> next;
+    {
+      Shard &shard = shardFor(id);
+      unique_lock guard(shard.lock);
+      auto item = shard.storage.get(id);
+      if (item == nullptr) {
+        return nullptr;
+      }
+      next = make(static_cast<const T &>(**item));
+      replaced = *item;
+      shard.storage.put(id, next);
+      slotFor(shard, id).store(next.get(), memory_order_release);
+    }
+    EpochDomain::global().retire(std::move(replaced));
+    return next;
+  }
+
+  bool remove(int id) {
+    shared_ptr<T> removed;
+    {
+      Shard &shard = shardFor(id);
+      unique_lock guard(shard.lock);
+      auto item = shard.storage.get(id);
+      if (item == nullptr) {
+        return false;
+      }
+      removed = *item;
+      shard.storage.erase(id);
+      slotFor(shard, id).store(nullptr, memory_order_release);
+    }
+    // Borrowed readers may still hold the pointer; defer the release
+    EpochDomain::global().retire(std::move(removed));
+    return true;
+  }
+
+  size_t count() const {
+    size_t total = 0;
+    for (const Shard &shard : shards) {
+      shared_lock guard(shard.lock);
+      total += shard.storage.size();
+    }
+    return total;
+  }
+};
+
+/**
+ * Map from id to a small nonzero number, such as a row, for tables kept
+ * beside the repository. As in DenseSlotStorage, recent ids sit in a
+ * window array from `base` upwards that spans at most Spread ids per id
+ * held in it, plus Slack. Older ids that would leave the window sparse
+ * move to a hash map, so memory follows the ids held, not the largest one.
+ */
+class IdSlotMap {
+private:
+  // A hash entry costs about as much as eight window slots
+  static constexpr size_t Spread = 8;
+  static constexpr size_t Slack = 64;
+
+  int base = 1;
+  vector<uint32_t> window; // id - base -> value, 0 when absent
+  size_t windowLive = 0;
+  unordered_map<int, uint32_t> below; // ids under `base`
+
+  static bool dense(size_t span, size_t count) {
+    return span <= Spread * count + Slack;
+  }
+
+  // Move window[0, cut) into `below`; the window then starts at base + cut
+  void cut(size_t cut) {
+    for (size_t i = 0; i < cut; ++i) {
+      if (window[i] != 0) {
+        below.emplace(base + static_cast<int>(i), window[i]);
+        --windowLive;
+      }
+    }
+    window.erase(window.begin(), window.begin() + cut);
+    base += static_cast<int>(cut);
+    if (window.capacity() > 2 * window.size() + Slack) {
+      window.shrink_to_fit();
+    }
+  }
+
+  // Keep the longest suffix dense at half the spread, so about half the
+  // window has to go before this runs again
+  void rebase() {
+    size_t from = window.size();
+    size_t count = 0;
+    for (size_t i = window.size(); i-- > 0;) {
+      count += window[i] != 0;
+      if (window.size() - i <= Spread / 2 * count + Slack) {
+        from = i;
+      }
+    }
+    cut(from);
+  }
+
+public:
+  uint32_t get(int id) const {
+    if (id >= base) {
+      size_t at = size_t(id - base);
+      return at < window.size() ? window[at] : 0;
+    }
+    auto it = below.find(id);
+    return it != below.end() ? it->second : 0;
+  }
+
+  void set(int id, uint32_t value) {
+    if (id < base) {
+      below[id] = value;
+      return;
+    }
+    size_t at = size_t(id - base);
+    if (at >= window.size()) {
+      if (!dense(at + 1, windowLive + 1)) {
+        // Too far past the window: start a new one at this id
+        cut(window.size());
+        base = id;
+        at = 0;
+      }
+      window.resize(at + 1);
+    }
+    windowLive += window[at] == 0;
+    window[at] = value;
+  }
+
+  void erase(int id) {
+    if (id < base) {
+      below.erase(id);
+      if (below.bucket_count() > Slack &&
+          below.size() * 4 < below.bucket_count()) {
+        below.rehash(0);
+      }
+      return;
+    }
+    size_t at = size_t(id - base);
+    if (at >= window.size() || window[at] == 0) {
+      return;
+    }
+    window[at] = 0;
+    --windowLive;
+    if (!dense(window.size(), windowLive)) {
+      rebase();
+    }
+  }
+
+  void shrinkToFit() {
+    window.shrink_to_fit();
+    below.rehash(0);
+  }
+
+  // Bytes reserved by the window, the hash buckets and their nodes
+  size_t memoryBytes() const {
+    return window.capacity() * sizeof(uint32_t) +
+           below.bucket_count() * sizeof(void *) +
+           below.size() * (sizeof(pair<const int, uint32_t>) + sizeof(void *));
+  }
+};
+
+/**
+ * Columnar copy of the user store: ids, ages and timestamps sit in
+ * contiguous arrays so scans stream through memory instead of chasing
+ * one pointer per user. Rows are swap-removed to keep the columns packed.
+ */
+class UserTable : public UserListener {
+private:
+  vector<int> ids;
+  vector<int> ages;
+  vector<CoarseClock::Ticks> createdAt;
+  vector<UserStrings> strings; // offsets into the shared StringStore
+  IdSlotMap rowOfId; // id -> row + 1, 0 when absent
+
+public:
+  /**
+   * Read-only row view over the columns
+   */
+  class Row {
+  private:
+    const UserTable *table;
+    size_t row;
+
+  public:
+    Row(const UserTable *table, size_t row) : table(table), row(row) {}
+
+    int getId() const { return table->ids[row]; }
+    string_view getName() const {
+      return StringStore::instance().get(table->strings[row].name);
+    }
+    EmailView getEmail() const { return resolveEmail(table->strings[row]); }
+    int getAge() const { return table->ages[row]; }
+    chrono::system_clock::time_point getCreatedAt() const {
+      return CoarseClock::toTimePoint(table->createdAt[row]);
+    }
+    bool isAdult() const { return getAge() >= 18; }
+  };
+
+  void reserve(size_t n) {
+    ids.reserve(n);
+    ages.reserve(n);
+    createdAt.reserve(n);
+    strings.reserve(n);
+  }
+
+  void shrinkToFit() {
+    ids.shrink_to_fit();
+    ages.shrink_to_fit();
+    createdAt.shrink_to_fit();
+    strings.shrink_to_fit();
+    rowOfId.shrinkToFit();
+  }
+
+  void insert(const User &user) {
+    int id = user.getId();
+    ids.push_back(id);
+    ages.push_back(user.getAge());
+    createdAt.push_back(user.getCreatedTicks());
+    strings.push_back(user.getStrings());
+    rowOfId.set(id, static_cast<uint32_t>(ids.size()));
+  }
+
+  bool erase(int id) {
+    uint32_t slot = rowOfId.get(id);
+    if (slot == 0) {
+      return false;
+    }
+    size_t row = slot - 1;
+    size_t last = ids.size() - 1;
+
+    if (row != last) {
+      ids[row] = ids[last];
+      ages[row] = ages[last];
+      createdAt[row] = createdAt[last];
+      strings[row] = strings[last];
+      rowOfId.set(ids[row], static_cast<uint32_t>(row + 1));
+    }
+    ids.pop_back();
+    ages.pop_back();
+    createdAt.pop_back();
+    strings.pop_back();
+    rowOfId.erase(id);
+    return true;
+  }
+
+  void onUserChanged(const User &user) override {
+    uint32_t slot = rowOfId.get(user.getId());
+    if (slot == 0) {
+      return;
+    }
+    size_t row = slot - 1;
+    ages[row] = user.getAge();
+    strings[row] = user.getStrings();
+  }
+
+  optional<Row> find(int id) const {
+    uint32_t slot = rowOfId.get(id);
+    if (slot == 0) {
+      return nullopt;
+    }
+    return Row(this, slot - 1);
+  }
+
+  // Visit rows whose age satisfies the predicate; only the age column is read
+  template <typename Pred, typename F>
+  void scanAges(Pred &&pred, F &&fn) const {
+    for (size_t row = 0; row < ages.size(); ++row) {
+      if (pred(ages[row])) {
+        fn(Row(this, row));
+      }
+    }
+  }
+
+  const vector<int> &idColumn() const { return ids; }
+  const vector<int> &ageColumn() const { return ages; }
+  const vector<CoarseClock::Ticks> &createdAtColumn() const {
+    return createdAt;
+  }
+  const vector<UserStrings> &stringColumn() const { return strings; }
+  Row row(size_t index) const { return Row(this, index); }
+  size_t size() const { return ids.size(); }
+
+  // Bytes reserved by the columns and the id -> row map
+  size_t memoryBytes() const {
+    return ids.capacity() * sizeof(int) + ages.capacity() * sizeof(int) +
+           createdAt.capacity() * sizeof(createdAt[0]) +
+           strings.capacity() * sizeof(UserStrings) +
+           rowOfId.memoryBytes();
+  }
+};
+
+/**
+ * Scan kernels over a packed int column. Each operation has a scalar
+ * version plus AVX2 and NEON variants; the best one is picked at startup.
+ */
+namespace kernels {
+
+struct MinMax {
+  int min;
+  int max;
+};
+
+inline size_t countAtLeastScalar(const int *values, size_t n, int bound) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    count += values[i] >= bound;
+  }
+  return count;
+}
+
+inline int64_t sumScalar(const int *values, size_t n) {
+  int64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += values[i];
+  }
+  return total;
+}
+
+inline MinMax minMaxScalar(const int *values, size_t n) {
+  MinMax result{INT32_MAX, INT32_MIN};
+  for (size_t i = 0; i < n; ++i) {
+    result.min = min(result.min, values[i]);
+    result.max = max(result.max, values[i]);
+  }
+  return result;
+}
+
+// Bit i of the output is set when values[i] >= bound
+inline void maskAtLeastScalar(const int *values, size_t n, int bound,
+                              uint64_t *bits) {
+  for (size_t word = 0; word * 64 < n; ++word) {
+    uint64_t mask = 0;
+    size_t end = min<size_t>(64, n - word * 64);
+    for (size_t j = 0; j < end; ++j) {
+      mask |= uint64_t(values[word * 64 + j] >= bound) << j;
+    }
+    bits[word] = mask;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2"))) inline size_t
+countAtLeastAvx2(const int *values, size_t n, int bound) {
+  // AVX2 has no signed >=, and bound - 1 overflows at INT_MIN, so the
+  // loop counts the misses (bound > v) and the hits are the rest
+  __m256i limit = _mm256_set1_epi32(bound);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+    // Missing lanes are -1, so subtracting counts them
+    acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(limit, v));
+  }
+  alignas(32) uint32_t lanes[8];
+  _mm256_store_si256((__m256i *)lanes, acc);
+  size_t misses = 0;
+  for (uint32_t lane : lanes) {
+    misses += lane;
+  }
+  return i - misses + countAtLeastScalar(values + i, n - i, bound);
+}
+
+__attribute__((target("avx2"))) inline int64_t sumAvx2(const int *values,
+                                                       size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+    acc = _mm256_add_epi64(
+        acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    acc = _mm256_add_epi64(
+        acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+  }
+  alignas(32) int64_t lanes[4];
+  _mm256_store_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         sumScalar(values + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline MinMax minMaxAvx2(const int *values,
+                                                        size_t n) {
+  __m256i lo = _mm256_set1_epi32(INT32_MAX);
+  __m256i hi = _mm256_set1_epi32(INT32_MIN);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+    lo = _mm256_min_epi32(lo, v);
+    hi = _mm256_max_epi32(hi, v);
+  }
+  alignas(32) int lows[8];
+  alignas(32) int highs[8];
+  _mm256_store_si256((__m256i *)lows, lo);
+  _mm256_store_si256((__m256i *)highs, hi);
+  MinMax result = minMaxScalar(values + i, n - i);
+  for (int j = 0; j < 8; ++j) {
+    result.min = min(result.min, lows[j]);
+    result.max = max(result.max, highs[j]);
+  }
+  return result;
+}
+
+__attribute__((target("avx2"))) inline void
+maskAtLeastAvx2(const int *values, size_t n, int bound, uint64_t *bits) {
+  // v >= bound as NOT(bound > v), as in countAtLeastAvx2
+  __m256i limit = _mm256_set1_epi32(bound);
+  size_t word = 0;
+  for (; (word + 1) * 64 <= n; ++word) {
+    uint64_t misses = 0;
+    for (int block = 0; block < 8; ++block) {
+      __m256i v = _mm256_loadu_si256(
+          (const __m256i *)(values + word * 64 + block * 8));
+      __m256 miss = _mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, v));
+      misses |= uint64_t(_mm256_movemask_ps(miss)) << (block * 8);
+    }
+    bits[word] = ~misses;
+  }
+  maskAtLeastScalar(values + word * 64, n - word * 64, bound, bits + word);
+}
+
+#elif defined(__aarch64__)
+
+inline size_t countAtLeastNeon(const int *values, size_t n, int bound) {
+  int32x4_t limit = vdupq_n_s32(bound);
+  uint32x4_t acc = vdupq_n_u32(0);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t hit = vcgeq_s32(vld1q_s32(values + i), limit);
+    acc = vsubq_u32(acc, hit);
+  }
+  return vaddvq_u32(acc) + countAtLeastScalar(values + i, n - i, bound);
+}
+
+inline int64_t sumNeon(const int *values, size_t n) {
+  int64x2_t acc = vdupq_n_s64(0);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = vpadalq_s32(acc, vld1q_s32(values + i));
+  }
+  return vaddvq_s64(acc) + sumScalar(values + i, n - i);
+}
+
+inline MinMax minMaxNeon(const int *values, size_t n) {
+  int32x4_t lo = vdupq_n_s32(INT32_MAX);
+  int32x4_t hi = vdupq_n_s32(INT32_MIN);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t v = vld1q_s32(values + i);
+    lo = vminq_s32(lo, v);
+    hi = vmaxq_s32(hi, v);
+  }
+  MinMax result = minMaxScalar(values + i, n - i);
+  result.min = min(result.min, vminvq_s32(lo));
+  result.max = max(result.max, vmaxvq_s32(hi));
+  return result;
+}
+
+inline void maskAtLeastNeon(const int *values, size_t n, int bound,
+                            uint64_t *bits) {
+  static const uint32_t weights[4] = {1, 2, 4, 8};
+  int32x4_t limit = vdupq_n_s32(bound);
+  uint32x4_t weight = vld1q_u32(weights);
+  size_t word = 0;
+  for (; (word + 1) * 64 <= n; ++word) {
+    uint64_t mask = 0;
+    for (int block = 0; block < 16; ++block) {
+      int32x4_t v = vld1q_s32(values + word * 64 + block * 4);
+      uint32x4_t hit = vandq_u32(vcgeq_s32(v, limit), weight);
+      mask |= uint64_t(vaddvq_u32(hit)) << (block * 4);
+    }
+    bits[word] = mask;
+  }
+  maskAtLeastScalar(values + word * 64, n - word * 64, bound, bits + word);
+}
+
+#endif
+
+// Dispatch table filled once from what the CPU supports
+struct Table {
+  size_t (*countAtLeast)(const int *, size_t, int);
+  int64_t (*sum)(const int *, size_t);
+  MinMax (*minMax)(const int *, size_t);
+  void (*maskAtLeast)(const int *, size_t, int, uint64_t *);
+};
+
+inline const Table &active() {
+  static const Table table = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+      return Table{countAtLeastAvx2, sumAvx2, minMaxAvx2, maskAtLeastAvx2};
+    }
+#elif defined(__aarch64__)
+    return Table{countAtLeastNeon, sumNeon, minMaxNeon, maskAtLeastNeon};
+#endif
+    return Table{countAtLeastScalar, sumScalar, minMaxScalar,
+                 maskAtLeastScalar};
+  }();
+  return table;
+}
+
+} // namespace kernels
+
+/**
+ * Fixed-size work-stealing thread pool. Each worker owns a deque: it
+ * pops its own newest task and steals the oldest task of a busy peer
+ * when it runs dry. Threads waiting in parallelFor() run queued tasks
+ * instead of blocking, so nested parallel loops cannot deadlock.
+ */
+class WorkStealingPool {
+private:
+  struct alignas(64) Queue {
+    mutex lock;
+    deque<function<void()>> tasks;
+  };
+
+  vector<unique_ptr<Queue>> queues;
+  vector<thread> workers;
+  atomic<size_t> queued{0};
+  atomic<size_t> nextQueue{0};
+  mutex idleLock;
+  condition_variable idle;
+  bool stopping = false;
+
+  static inline thread_local WorkStealingPool *currentPool = nullptr;
+  static inline thread_local size_t currentQueue = 0;
+
+  bool tryRun(size_t home) {
+    function<void()> task;
+    for (size_t i = 0; i < queues.size() && !task; ++i) {
+      Queue &queue = *queues[(home + i) % queues.size()];
+      lock_guard guard(queue.lock);
+      if (queue.tasks.empty()) {
+        continue;
+      }
+      // Own work is taken LIFO while it is hot in cache; steals are FIFO
+      if (i == 0 && currentPool == this) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+    }
+    if (!task) {
+      return false;
+    }
+    queued.fetch_sub(1, memory_order_relaxed);
+    task();
+    return true;
+  }
+
+  void workerLoop(size_t index) {
+    currentPool = this;
+    currentQueue = index;
+    while (true) {
+      if (tryRun(index)) {
+        continue;
+      }
+      unique_lock guard(idleLock);
+      idle.wait(guard, [&] {
+        return stopping || queued.load(memory_order_relaxed) != 0;
+      });
+      if (stopping && queued.load(memory_order_relaxed) == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  // Zero threads is valid: every loop then runs on the calling thread.
+  // With `node` set the workers only run on that node's CPUs.
+  explicit WorkStealingPool(size_t threads,
+                            const numa::Node *node = nullptr) {
+    for (size_t i = 0; i < threads; ++i) {
+      queues.push_back(make_unique<Queue>());
+    }
+    optional<numa::Node> pinTo;
+    if (node != nullptr) {
+      pinTo = *node;
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      workers.emplace_back([this, i, pinTo] {
+        if (pinTo) {
+          numa::pin(*pinTo);
+        }
+        workerLoop(i);
+      });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  // Drains every queued task before joining the workers
+  ~WorkStealingPool() {
+    {
+      lock_guard guard(idleLock);
+      stopping = true;
+    }
+    idle.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  size_t size() const { return workers.size(); }
+
+  void submit(function<void()> task) {
+    if (workers.empty()) {
+      task();
+      return;
+    }
+    size_t index = currentPool == this
+                       ? currentQueue
+                       : nextQueue.fetch_add(1, memory_order_relaxed) %
+                             queues.size();
+    {
+      lock_guard guard(queues[index]->lock);
+      queues[index]->tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1, memory_order_relaxed);
+    {
+      lock_guard guard(idleLock); // pairs with the check in workerLoop
+    }
+    idle.notify_one();
+  }
+
+  /**
+   * Calls fn(begin, end) over [0, count) in chunks of `grain` and waits
+   * for all of them. The caller runs the first chunk itself; a single
+   * chunk never leaves the calling thread. The first exception thrown by
+   * any chunk is rethrown here.
+   */
+  template <typename F> void parallelFor(size_t count, size_t grain, F &&fn) {
+    grain = max<size_t>(grain, 1);
+    size_t chunks = (count + grain - 1) / grain;
+    if (chunks <= 1 || workers.empty()) {
+      if (count != 0) {
+        fn(size_t(0), count);
+      }
+      return;
+    }
+
+    atomic<size_t> remaining{chunks};
+    mutex errorLock;
+    exception_ptr error;
+    auto runChunk = [&](size_t chunk) {
+      try {
+        fn(chunk * grain, min(count, (chunk + 1) * grain));
+      } catch (...) {
+        lock_guard guard(errorLock);
+        if (!error) {
+          error = current_exception();
+        }
+      }
+      remaining.fetch_sub(1, memory_order_acq_rel);
+    };
+
+    for (size_t chunk = 1; chunk < chunks; ++chunk) {
+      submit([&runChunk, chunk] { runChunk(chunk); });
+    }
+    runChunk(0);
+    size_t home = currentPool == this ? currentQueue : 0;
+    while (remaining.load(memory_order_acquire) != 0) {
+      if (!tryRun(home)) {
+        this_thread::yield();
+      }
+    }
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+};
+
+/**
+ * Parallel versions of the sort/find/transform/reduce stages. With
+ * USE_STD_EXECUTION (libstdc++ then needs -ltbb) they forward to the
+ * std::execution::par_unseq overloads; otherwise they run on a shared
+ * WorkStealingPool. Inputs of one grain or less stay on the caller.
+ */
+namespace parallel {
+
+constexpr size_t Grain = 1 << 14;
+
+// The caller helps with every loop, so one hardware thread is left free
+inline WorkStealingPool &defaultPool() {
+  static WorkStealingPool pool(max(thread::hardware_concurrency(), 1u) - 1);
+  return pool;
+}
+
+template <typename T, typename Compare = less<>>
+void sort(vector<T> &items, Compare compare = {}) {
+#ifdef HAVE_STD_EXECUTION
+  std::sort(execution::par_unseq, items.begin(), items.end(), compare);
+#else
+  WorkStealingPool &pool = defaultPool();
+  size_t n = items.size();
+  if (n <= Grain || pool.size() == 0) {
+    std::sort(items.begin(), items.end(), compare);
+    return;
+  }
+
+  // Sort one run per thread, then merge neighbouring runs pairwise
+  size_t runs = min(pool.size() + 1, (n + Grain - 1) / Grain);
+  size_t width = (n + runs - 1) / runs;
+  auto at = [&](size_t index) { return items.begin() + min(index, n); };
+  pool.parallelFor(runs, 1, [&](size_t first, size_t last) {
+    for (size_t run = first; run < last; ++run) {
+      std::sort(at(run * width), at((run + 1) * width), compare);
+    }
+  });
+  for (; width < n; width *= 2) {
+    size_t pairs = (n + 2 * width - 1) / (2 * width);
+    pool.parallelFor(pairs, 1, [&](size_t first, size_t last) {
+      for (size_t pair = first; pair < last; ++pair) {
+        size_t low = pair * 2 * width;
+        inplace_merge(at(low), at(low + width), at(low + 2 * width), compare);
+      }
+    });
+  }
+#endif
+}
+
+// Index of the first element equal to `value`, or items.size()
+template <typename T> size_t find(const vector<T> &items, const T &value) {
+#ifdef HAVE_STD_EXECUTION
+  return std::find(execution::par_unseq, items.begin(), items.end(), value) -
+         items.begin();
+#else
+  atomic<size_t> found{items.size()};
+  defaultPool().parallelFor(items.size(), Grain, [&](size_t first,
+                                                     size_t last) {
+    // Chunks past an earlier match have nothing to contribute
+    for (size_t i = first; i < last && i < found.load(memory_order_relaxed);
+         ++i) {
+      if (items[i] == value) {
+        size_t best = found.load(memory_order_relaxed);
+        while (i < best && !found.compare_exchange_weak(best, i)) {
+        }
+        return;
+      }
+    }
+  });
+  return found.load();
+#endif
+}
+
+// Maps and folds in one pass, so filter/transform stages need no
+// intermediate vector. `reduce` must be associative.
+template <typename T, typename Acc, typename Reduce, typename Transform>
+Acc transformReduce(const vector<T> &items, Acc init, Reduce reduce,
+                    Transform transform) {
+#ifdef HAVE_STD_EXECUTION
+  return std::transform_reduce(execution::par_unseq, items.begin(),
+                               items.end(), init, reduce, transform);
+#else
+  WorkStealingPool &pool = defaultPool();
+  size_t chunks = (items.size() + Grain - 1) / Grain;
+  if (chunks <= 1 || pool.size() == 0) {
+    return std::transform_reduce(items.begin(), items.end(), init, reduce,
+                                 transform);
+  }
+  vector<optional<Acc>> partial(chunks);
+  pool.parallelFor(items.size(), Grain, [&](size_t first, size_t last) {
+    auto begin = items.begin() + first;
+    partial[first / Grain] = std::transform_reduce(
+        begin + 1, items.begin() + last, Acc(transform(*begin)), reduce,
+        transform);
+  });
+  for (auto &value : partial) {
+    init = reduce(std::move(init), std::move(*value));
+  }
+  return init;
+#endif
+}
+
+template <typename T> T reduce(const vector<T> &items, T init) {
+  return transformReduce(items, init, plus<>(), [](const T &x) { return x; });
+}
+
+} // namespace parallel
+
+// Timestamps are persisted as nanoseconds since the epoch
+inline int64_t toEpochNanos(chrono::system_clock::time_point time) {
+  return chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch())
+      .count();
+}
+
+inline chrono::system_clock::time_point fromEpochNanos(int64_t nanos) {
+  return chrono::system_clock::time_point(
+      chrono::duration_cast<chrono::system_clock::duration>(
+          chrono::nanoseconds(nanos)));
+}
+
+// A rename is durable only once the directory holding it is synced;
+// returns false with errno set on failure
+inline bool syncParentDirectory(const string &path) {
+  size_t slash = path.find_last_of('/');
+  string directory = slash == string::npos ? "."
+                     : slash == 0          ? "/"
+                                           : path.substr(0, slash);
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = ::fsync(fd) == 0;
+  int error = errno;
+  ::close(fd);
+  errno = error;
+  return synced;
+}
+
+/**
+ * Binary snapshot of the user table, version 3, in native byte order:
+ * a fixed header, one array per column and a string arena holding
+ * length-prefixed names, email local parts and deduplicated domains.
+ * Sections start on 64-byte boundaries so a mapped file is read in place.
+ */
+namespace snapshot {
+
+constexpr char Magic[8] = {'U', 'S', 'E', 'R', 'S', 'N', 'A', 'P'};
+constexpr uint32_t Version = 3;
+constexpr uint64_t Alignment = 64;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint64_t rows;
+  uint64_t logSequence; // last write-ahead log record already included
+  uint64_t nextId;      // every stored id lies in [1, nextId)
+  uint64_t idsOffset;        // int32_t[rows]
+  uint64_t agesOffset;       // int32_t[rows]
+  uint64_t createdAtOffset;  // int64_t[rows], nanoseconds since the epoch
+  uint64_t namesOffset;      // uint32_t[rows], arena offsets
+  uint64_t emailLocalOffset; // uint32_t[rows], arena offsets
+  uint64_t emailDomainOffset; // uint32_t[rows], arena offset or NoString
+  uint64_t arenaOffset;
+  uint64_t arenaSize;
+};
+
+static_assert(sizeof(int) == sizeof(int32_t));
+
+// Point-in-time copy of the table columns. Strings stay as StringStore
+// offsets: the store never rewrites bytes, so no lock is needed later.
+struct Image {
+  uint64_t logSequence = 0;
+  int nextId = 1;
+  vector<int> ids;
+  vector<int> ages;
+  vector<CoarseClock::Ticks> createdAt;
+  vector<UserStrings> strings;
+  shared_ptr<StringStore::Pin> pin; // keeps `strings` resolvable
+};
+
+inline Image capture(const UserTable &table, uint64_t logSequence,
+                     int nextId) {
+  return {logSequence,
+          nextId,
+          table.idColumn(),
+          table.ageColumn(),
+          table.createdAtColumn(),
+          table.stringColumn(),
+          make_shared<StringStore::Pin>()};
+}
+
+inline void writeFully(int fd, const void *data, size_t size,
+                       uint64_t offset) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t written = ::pwrite(fd, bytes, size, static_cast<off_t>(offset));
+    if (written < 0) {
+      throw runtime_error("Snapshot write failed: " + string(strerror(errno)));
+    }
+    bytes += written;
+    offset += written;
+    size -= written;
+  }
+}
+
+// Writes to `path`.tmp, syncs it, renames it over `path` and syncs the
+// directory, so readers only ever map a complete snapshot and the rename
+// survives a crash
+inline void write(const Image &image, const string &path) {
+  const StringStore &store = StringStore::instance();
+  size_t rows = image.ids.size();
+  string arena;
+  vector<uint32_t> names(rows), locals(rows), domains(rows);
+  unordered_map<uint32_t, uint32_t> domainOffsets;
+
+  auto append = [&](string_view text) {
+    auto offset = static_cast<uint32_t>(arena.size());
+    auto length = static_cast<uint16_t>(text.size());
+    arena.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    arena.append(text);
+    return offset;
+  };
+
+  vector<int64_t> createdAt(rows);
+  for (size_t row = 0; row < rows; ++row) {
+    const UserStrings &strings = image.strings[row];
+    names[row] = append(store.get(strings.name));
+    locals[row] = append(store.get(strings.emailLocal));
+    domains[row] = StringStore::NoString;
+    if (strings.emailDomain != StringStore::NoString) {
+      auto [it, added] = domainOffsets.try_emplace(strings.emailDomain, 0);
+      if (added) {
+        it->second = append(store.get(strings.emailDomain));
+      }
+      domains[row] = it->second;
+    }
+    createdAt[row] =
+        toEpochNanos(CoarseClock::toTimePoint(image.createdAt[row]));
+  }
+  if (arena.size() >= StringStore::NoString) {
+    throw length_error("Snapshot string arena exceeds 4 GiB");
+  }
+
+  Header header{};
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  header.headerSize = sizeof(Header);
+  header.rows = rows;
+  header.logSequence = image.logSequence;
+  header.nextId = static_cast<uint64_t>(image.nextId);
+
+  uint64_t end = sizeof(Header);
+  auto section = [&](uint64_t bytes) {
+    uint64_t offset = (end + Alignment - 1) / Alignment * Alignment;
+    end = offset + bytes;
+    return offset;
+  };
+  header.idsOffset = section(rows * sizeof(int32_t));
+  header.agesOffset = section(rows * sizeof(int32_t));
+  header.createdAtOffset = section(rows * sizeof(int64_t));
+  header.namesOffset = section(rows * sizeof(uint32_t));
+  header.emailLocalOffset = section(rows * sizeof(uint32_t));
+  header.emailDomainOffset = section(rows * sizeof(uint32_t));
+  header.arenaOffset = section(arena.size());
+  header.arenaSize = arena.size();
+
+  string temporary = path + ".tmp";
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw runtime_error("Cannot create snapshot " + temporary + ": " +
+                        strerror(errno));
+  }
+  try {
+    // Padding between sections is left to ftruncate, which zero-fills
+    if (::ftruncate(fd, static_cast<off_t>(end)) != 0) {
+      throw runtime_error("Snapshot resize failed: " + string(strerror(errno)));
+    }
+    writeFully(fd, &header, sizeof(header), 0);
+    writeFully(fd, image.ids.data(), rows * sizeof(int32_t), header.idsOffset);
+    writeFully(fd, image.ages.data(), rows * sizeof(int32_t),
+               header.agesOffset);
+    writeFully(fd, createdAt.data(), rows * sizeof(int64_t),
+               header.createdAtOffset);
+    writeFully(fd, names.data(), rows * sizeof(uint32_t), header.namesOffset);
+    writeFully(fd, locals.data(), rows * sizeof(uint32_t),
+               header.emailLocalOffset);
+    writeFully(fd, domains.data(), rows * sizeof(uint32_t),
+               header.emailDomainOffset);
+    writeFully(fd, arena.data(), arena.size(), header.arenaOffset);
+    if (::fsync(fd) != 0) {
+      throw runtime_error("Snapshot sync failed: " + string(strerror(errno)));
+    }
+  } catch (...) {
+    ::close(fd);
+    ::unlink(temporary.c_str());
+    throw;
+  }
+  ::close(fd);
+  if (::rename(temporary.c_str(), path.c_str()) != 0) {
+    ::unlink(temporary.c_str());
+    throw runtime_error("Cannot publish snapshot " + path + ": " +
+                        strerror(errno));
+  }
+  if (!syncParentDirectory(path)) {
+    throw runtime_error("Cannot sync directory of snapshot " + path + ": " +
+                        strerror(errno));
+  }
+}
+
+// Serializes on a background thread; the caller keeps writing meanwhile.
+// `published` runs there once the file is in place.
+inline future<void> writeAsync(Image image, string path,
+                               function<void()> published = {}) {
+  return async(launch::async,
+               [image = std::move(image), path = std::move(path),
+                published = std::move(published)] {
+                 write(image, path);
+                 if (published) {
+                   published();
+                 }
+               });
+}
+
+/**
+ * Read-only memory mapping of a snapshot file. Opening validates the
+ * header and section bounds only; rows are read straight from the
+ * mapping, so nothing is parsed or allocated per record.
+ */
+class Mapped {
+private:
+  const char *base = nullptr;
+  size_t length = 0;
+  Header header{};
+
+  template <typename C> span<const C> column(uint64_t offset) const {
+    return {reinterpret_cast<const C *>(base + offset),
+            static_cast<size_t>(header.rows)};
+  }
+
+  string_view text(uint32_t offset) const {
+    if (offset == StringStore::NoString) {
+      return {};
+    }
+    const char *arena = base + header.arenaOffset;
+    uint16_t size;
+    if (uint64_t(offset) + sizeof(size) > header.arenaSize) {
+      throw runtime_error("Snapshot string offset out of range");
+    }
+    memcpy(&size, arena + offset, sizeof(size));
+    if (uint64_t(offset) + sizeof(size) + size > header.arenaSize) {
+      throw runtime_error("Snapshot string overruns the arena");
+    }
+    return {arena + offset + sizeof(size), size};
+  }
+
+  void validate(const string &path) const {
+    auto fits = [&](uint64_t offset, uint64_t width) {
+      return offset % Alignment == 0 && offset <= length &&
+             header.rows <= (length - offset) / width;
+    };
+    bool valid = length >= sizeof(Header) &&
+                 memcmp(header.magic, Magic, sizeof(Magic)) == 0 &&
+                 header.version == Version &&
+                 header.headerSize == sizeof(Header) &&
+                 header.nextId >= 1 && header.nextId <= INT_MAX &&
+                 header.rows < header.nextId &&
+                 fits(header.idsOffset, sizeof(int32_t)) &&
+                 fits(header.agesOffset, sizeof(int32_t)) &&
+                 fits(header.createdAtOffset, sizeof(int64_t)) &&
+                 fits(header.namesOffset, sizeof(uint32_t)) &&
+                 fits(header.emailLocalOffset, sizeof(uint32_t)) &&
+                 fits(header.emailDomainOffset, sizeof(uint32_t)) &&
+                 header.arenaOffset <= length &&
+                 header.arenaSize <= length - header.arenaOffset;
+    if (!valid) {
+      throw runtime_error("Not a valid user snapshot: " + path);
+    }
+  }
+
+public:
+  explicit Mapped(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw runtime_error("Cannot open snapshot " + path + ": " +
+                          strerror(errno));
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw runtime_error("Cannot stat snapshot " + path);
+    }
+    length = static_cast<size_t>(info.st_size);
+    if (length >= sizeof(Header)) {
+      void *mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("Cannot map snapshot " + path);
+      }
+      base = static_cast<const char *>(mapping);
+      memcpy(&header, base, sizeof(Header));
+    }
+    ::close(fd); // the mapping keeps the file alive
+    try {
+      validate(path);
+    } catch (...) {
+      if (base != nullptr) {
+        ::munmap(const_cast<char *>(base), length);
+      }
+      throw;
+    }
+  }
+
+  Mapped(const Mapped &) = delete;
+  Mapped &operator=(const Mapped &) = delete;
+
+  ~Mapped() { ::munmap(const_cast<char *>(base), length); }
+
+  size_t size() const { return static_cast<size_t>(header.rows); }
+  uint64_t logSequence() const { return header.logSequence; }
+  int nextId() const { return static_cast<int>(header.nextId); }
+
+  span<const int32_t> ids() const { return column<int32_t>(header.idsOffset); }
+  span<const int32_t> ages() const {
+    return column<int32_t>(header.agesOffset);
+  }
+
+  chrono::system_clock::time_point createdAt(size_t row) const {
+    return fromEpochNanos(column<int64_t>(header.createdAtOffset)[row]);
+  }
+
+  string_view name(size_t row) const {
+    return text(column<uint32_t>(header.namesOffset)[row]);
+  }
+
+  EmailView email(size_t row) const {
+    uint32_t domain = column<uint32_t>(header.emailDomainOffset)[row];
+    return {text(column<uint32_t>(header.emailLocalOffset)[row]),
+            text(domain), domain != StringStore::NoString};
+  }
+};
+
+} // namespace snapshot
+
+// CRC-32 (IEEE), used to detect torn or corrupted log records
+inline uint32_t crc32(const char *data, size_t size) {
+  static const auto table = [] {
+    array<uint32_t, 256> entries{};
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 1) ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+      }
+      entries[i] = crc;
+    }
+    return entries;
+  }();
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/**
+ * Append-only log of user mutations. Records are framed as
+ * [u32 length][u32 crc32][payload] and numbered by a sequence.
+ * commit() only encodes into a buffer; a background thread writes and
+ * fdatasyncs whole groups, holding each group open for up to the latency
+ * budget so concurrent writers share one sync. A group that every one of
+ * its records is already waiting on is synced at once, since holding it
+ * would only delay those waiters; writers arriving meanwhile gather in
+ * the next group while the sync runs.
+ */
+class WriteAheadLog {
+public:
+  enum class Type : uint8_t { Create = 1, Remove, SetName, SetEmail, SetAge };
+
+  // Decoded records view the log mapping and are valid during replay only
+  struct Record {
+    Type type;
+    uint64_t sequence = 0;
+    int id = 0;
+    int age = 0;
+    int64_t createdAt = 0; // nanoseconds since the epoch
+    string_view name{};
+    EmailView email{};
+  };
+
+  struct Options {
+    chrono::microseconds latencyBudget{1000};
+    size_t maxBatchBytes = 1 << 20; // sync early once a group is this big
+    bool synchronous = false; // commit() waits until its group is durable
+  };
+
+private:
+  static constexpr size_t FrameHeader = 2 * sizeof(uint32_t);
+
+  int fd = -1;
+  Options options;
+  mutable mutex lock;
+  condition_variable wake; // new group, flush request or shutdown
+  condition_variable durableChanged;
+  string pending;
+  uint64_t appended = 0; // last sequence handed out
+  uint64_t taken = 0;    // last sequence handed to the flusher
+  uint64_t durable = 0;  // last sequence known to be on disk
+  size_t groupWaiters = 0; // waits on sequences after `taken`
+  uint64_t dropThrough = 0;   // records a published snapshot covers
+  uint64_t droppedThrough = 0;
+  string path;
+  chrono::steady_clock::time_point groupStart;
+  bool flushRequested = false;
+  bool stopping = false;
+  string failure;
+  multimap<uint64_t, function<void(exception_ptr)>> waiters; // by sequence
+  thread flusher;
+
+  template <typename V> static void put(string &out, V value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void putString(string &out, string_view text) {
+    put(out, static_cast<uint16_t>(text.size()));
+    out.append(text);
+  }
+
+  static void putEmail(string &out, const EmailView &email) {
+    putString(out, email.local);
+    put(out, static_cast<uint8_t>(email.hasDomain));
+    putString(out, email.domain);
+  }
+
+  static void encode(string &out, const Record &record) {
+    size_t frame = out.size();
+    out.append(FrameHeader, '\0');
+    put(out, record.type);
+    put(out, record.sequence);
+    put(out, static_cast<int32_t>(record.id));
+    switch (record.type) {
+    case Type::Create:
+      put(out, static_cast<int32_t>(record.age));
+      put(out, record.createdAt);
+      putString(out, record.name);
+      putEmail(out, record.email);
+      break;
+    case Type::Remove:
+      break;
+    case Type::SetName:
+      putString(out, record.name);
+      break;
+    case Type::SetEmail:
+      putEmail(out, record.email);
+      break;
+    case Type::SetAge:
+      put(out, static_cast<int32_t>(record.age));
+      break;
+    }
+    auto length = static_cast<uint32_t>(out.size() - frame - FrameHeader);
+    uint32_t crc = crc32(out.data() + frame + FrameHeader, length);
+    memcpy(&out[frame], &length, sizeof(length));
+    memcpy(&out[frame + sizeof(length)], &crc, sizeof(crc));
+  }
+
+  // Bounds-checked cursor over one payload; any overrun clears `ok`
+  struct Reader {
+    string_view bytes;
+    bool ok = true;
+
+    template <typename V> V get() {
+      V value{};
+      if (bytes.size() < sizeof(V)) {
+        ok = false;
+        return value;
+      }
+      memcpy(&value, bytes.data(), sizeof(V));
+      bytes.remove_prefix(sizeof(V));
+      return value;
+    }
+
+    string_view text() {
+      auto size = get<uint16_t>();
+      if (!ok || bytes.size() < size) {
+        ok = false;
+        return {};
+      }
+      string_view value = bytes.substr(0, size);
+      bytes.remove_prefix(size);
+      return value;
+    }
+
+    EmailView email() {
+      EmailView value;
+      value.local = text();
+      value.hasDomain = get<uint8_t>() != 0;
+      value.domain = text();
+      return value;
+    }
+  };
+
+  static optional<Record> decode(string_view payload) {
+    Reader in{payload};
+    Record record{};
+    record.type = in.get<Type>();
+    record.sequence = in.get<uint64_t>();
+    record.id = in.get<int32_t>();
+    switch (record.type) {
+    case Type::Create:
+      record.age = in.get<int32_t>();
+      record.createdAt = in.get<int64_t>();
+      record.name = in.text();
+      record.email = in.email();
+      break;
+    case Type::Remove:
+      break;
+    case Type::SetName:
+      record.name = in.text();
+      break;
+    case Type::SetEmail:
+      record.email = in.email();
+      break;
+    case Type::SetAge:
+      record.age = in.get<int32_t>();
+      break;
+    default:
+      return nullopt;
+    }
+    if (!in.ok || !in.bytes.empty()) {
+      return nullopt;
+    }
+    return record;
+  }
+
+  // Returns the length of the valid prefix and the last sequence in it
+  template <typename F>
+  static pair<size_t, uint64_t> scan(string_view log, uint64_t after,
+                                     F &&replay) {
+    size_t offset = 0;
+    uint64_t last = 0;
+    while (log.size() - offset >= FrameHeader) {
+      uint32_t length;
+      uint32_t crc;
+      memcpy(&length, log.data() + offset, sizeof(length));
+      memcpy(&crc, log.data() + offset + sizeof(length), sizeof(crc));
+      if (length > log.size() - offset - FrameHeader) {
+        break;
+      }
+      string_view payload = log.substr(offset + FrameHeader, length);
+      auto record = crc32(payload.data(), payload.size()) == crc
+                        ? decode(payload)
+                        : nullopt;
+      if (!record) {
+        break;
+      }
+      if (record->sequence > after) {
+        replay(*record);
+      }
+      last = max(last, record->sequence);
+      offset += FrameHeader + length;
+    }
+    return {offset, last};
+  }
+
+  // Length of the leading records numbered up to `through`; the file
+  // holds records in sequence order
+  static size_t prefixThrough(string_view log, uint64_t through) {
+    size_t offset = 0;
+    while (log.size() - offset >= FrameHeader) {
+      uint32_t length;
+      memcpy(&length, log.data() + offset, sizeof(length));
+      if (length > log.size() - offset - FrameHeader) {
+        break;
+      }
+      auto record = decode(log.substr(offset + FrameHeader, length));
+      if (!record || record->sequence > through) {
+        break;
+      }
+      offset += FrameHeader + length;
+    }
+    return offset;
+  }
+
+  // Returns false with errno set when a write fails
+  static bool writeAll(int target, string_view bytes) {
+    while (!bytes.empty()) {
+      ssize_t written = ::write(target, bytes.data(), bytes.size());
+      if (written < 0 && errno != EINTR) {
+        return false;
+      }
+      if (written > 0) {
+        bytes.remove_prefix(static_cast<size_t>(written));
+      }
+    }
+    return true;
+  }
+
+  string writeGroup(const string &group) {
+    if (!writeAll(fd, group)) {
+      return "Log write failed: " + string(strerror(errno));
+    }
+    if (::fdatasync(fd) != 0) {
+      return "Log sync failed: " + string(strerror(errno));
+    }
+    return {};
+  }
+
+  /**
+   * Rewrites the file without the records up to `through` by copying the
+   * rest to `path`.tmp and renaming it over the log. Runs on the flusher
+   * between groups, so nothing else writes the file meanwhile. A failure
+   * before the rename keeps the whole old log, which is still correct;
+   * the next snapshot tries again. Only a failed directory sync after the
+   * rename is returned, since later groups might then not survive a crash.
+   */
+  string dropPrefix(uint64_t through) {
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+      return {};
+    }
+    auto size = static_cast<size_t>(info.st_size);
+    void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      return {};
+    }
+    string_view log(static_cast<const char *>(mapping), size);
+    size_t cut = prefixThrough(log, through);
+    string temporary = path + ".tmp";
+    int next = -1;
+    if (cut > 0) {
+      next = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                    0644);
+    }
+    bool copied = next >= 0 && writeAll(next, log.substr(cut)) &&
+                  ::fdatasync(next) == 0;
+    ::munmap(mapping, size);
+    if (!copied || ::rename(temporary.c_str(), path.c_str()) != 0) {
+      if (next >= 0) {
+        ::close(next);
+        ::unlink(temporary.c_str());
+      }
+      return {};
+    }
+    ::close(fd);
+    fd = next;
+    if (!syncParentDirectory(path)) {
+      return "Log directory sync failed: " + string(strerror(errno));
+    }
+    return {};
+  }
+
+  void run() {
+    unique_lock guard(lock);
+    string writing;
+    while (true) {
+      wake.wait(guard, [&] {
+        return stopping || !pending.empty() || dropThrough > droppedThrough;
+      });
+      if (dropThrough > droppedThrough) {
+        uint64_t through = dropThrough;
+        guard.unlock();
+        string error = dropPrefix(through);
+        guard.lock();
+        droppedThrough = through;
+        if (!error.empty() && failure.empty()) {
+          failure = std::move(error);
+        }
+        continue;
+      }
+      if (pending.empty()) {
+        return; // stopping, and everything is already on disk
+      }
+      // Hold the group open so more writers can join before the sync
+      wake.wait_until(guard, groupStart + options.latencyBudget, [&] {
+        return stopping || flushRequested ||
+               pending.size() >= options.maxBatchBytes ||
+               groupWaiters >= appended - taken;
+      });
+      writing.swap(pending);
+      uint64_t upTo = appended;
+      taken = upTo;
+      groupWaiters = 0;
+      flushRequested = false;
+
+      guard.unlock();
+      string error = writeGroup(writing);
+      writing.clear();
+      guard.lock();
+
+      if (error.empty()) {
+        durable = upTo;
+      } else if (failure.empty()) {
+        failure = std::move(error);
+      }
+      durableChanged.notify_all();
+
+      // Callbacks run without the lock so they may commit again
+      auto done = failure.empty() ? waiters.upper_bound(durable)
+                                  : waiters.end();
+      vector<function<void(exception_ptr)>> ready;
+      for (auto it = waiters.begin(); it != done; ++it) {
+        ready.push_back(std::move(it->second));
+      }
+      waiters.erase(waiters.begin(), done);
+      exception_ptr failed = failure.empty()
+                                 ? nullptr
+                                 : make_exception_ptr(runtime_error(failure));
+      guard.unlock();
+      for (auto &callback : ready) {
+        callback(failed);
+      }
+      guard.lock();
+    }
+  }
+
+  // Counts a wait on the open group, which may let it sync early
+  void joinGroup(uint64_t sequence) {
+    if (sequence > taken) {
+      ++groupWaiters;
+      wake.notify_one();
+    }
+  }
+
+  void awaitDurable(unique_lock<mutex> &guard, uint64_t sequence) {
+    joinGroup(sequence);
+    durableChanged.wait(
+        guard, [&] { return durable >= sequence || !failure.empty(); });
+    if (durable < sequence) {
+      throw runtime_error(failure);
+    }
+  }
+
+public:
+  /**
+   * Opens or creates the log at `path`. Existing records newer than
+   * `after` are passed to `replay` in order; a torn or corrupt tail is
+   * cut off, and new records are numbered after everything seen.
+   */
+  WriteAheadLog(const string &path, Options options, uint64_t after,
+                const function<void(const Record &)> &replay)
+      : options(options), path(path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+      throw runtime_error("Cannot open log " + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw runtime_error("Cannot stat log " + path);
+    }
+    auto size = static_cast<size_t>(info.st_size);
+    pair<size_t, uint64_t> valid{0, 0};
+    if (size > 0) {
+      void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("Cannot map log " + path);
+      }
+      try {
+        valid = scan({static_cast<const char *>(mapping), size}, after, replay);
+      } catch (...) {
+        ::munmap(mapping, size);
+        ::close(fd);
+        throw;
+      }
+      ::munmap(mapping, size);
+    }
+    if (valid.first < size &&
+        ::ftruncate(fd, static_cast<off_t>(valid.first)) != 0) {
+      ::close(fd);
+      throw runtime_error("Cannot cut torn tail of log " + path);
+    }
+    appended = taken = durable = max(after, valid.second);
+    flusher = thread([this] { run(); });
+  }
+
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  // Syncs whatever is still buffered before closing
+  ~WriteAheadLog() {
+    {
+      lock_guard guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    flusher.join();
+    ::close(fd);
+  }
+
+  // Appends a record and returns its sequence number; in synchronous
+  // mode it first waits until the record is durable
+  uint64_t commit(Record record) {
+    uint64_t sequence = append(record);
+    if (options.synchronous) {
+      waitDurable(sequence);
+    }
+    return sequence;
+  }
+
+  // Appends a record without waiting, whatever the mode
+  uint64_t append(Record record) {
+    lock_guard guard(lock);
+    if (!failure.empty()) {
+      throw runtime_error(failure);
+    }
+    record.sequence = ++appended;
+    if (pending.empty()) {
+      groupStart = chrono::steady_clock::now();
+      wake.notify_one();
+    }
+    encode(pending, record);
+    if (pending.size() >= options.maxBatchBytes) {
+      wake.notify_one();
+    }
+    return record.sequence;
+  }
+
+  bool synchronous() const { return options.synchronous; }
+
+  // Blocks until the group holding `sequence` has been synced
+  void waitDurable(uint64_t sequence) {
+    unique_lock guard(lock);
+    awaitDurable(guard, sequence);
+  }
+
+  /**
+   * Calls `done` once the group holding `sequence` has been synced, or
+   * with the failure if it never will be. It runs on the flusher thread,
+   * or right away when the sequence is already durable.
+   */
+  void onDurable(uint64_t sequence, function<void(exception_ptr)> done) {
+    unique_lock guard(lock);
+    if (durable < sequence && failure.empty()) {
+      waiters.emplace(sequence, std::move(done));
+      joinGroup(sequence);
+      return;
+    }
+    exception_ptr failed = durable >= sequence
+                               ? nullptr
+                               : make_exception_ptr(runtime_error(failure));
+    guard.unlock();
+    done(failed);
+  }
+
+  // Starts syncing everything committed so far without waiting out the
+  // budget; returns the sequence that marks the end of it
+  uint64_t requestFlush() {
+    lock_guard guard(lock);
+    if (!pending.empty()) {
+      flushRequested = true;
+      wake.notify_one();
+    }
+    return appended;
+  }
+
+  void flush() { waitDurable(requestFlush()); }
+
+  // Lets the flusher drop records up to `sequence` from the file, once a
+  // published snapshot holds everything they did
+  void truncateThrough(uint64_t sequence) {
+    lock_guard guard(lock);
+    if (sequence > dropThrough) {
+      dropThrough = sequence;
+      wake.notify_one();
+    }
+  }
+
+  uint64_t lastSequence() const {
+    lock_guard guard(lock);
+    return appended;
+  }
+};
+
+/**
+ * Coroutine plumbing for the async UserService calls. Tasks are lazy:
+ * one starts when it is awaited or driven by syncWait. Awaiting
+ * durability registers a callback with the log and suspends, the log's
+ * flusher thread posts the coroutine to a CompletionQueue once the group
+ * commit lands, and the thread that drains the queue resumes it. So one
+ * thread can keep many mutations in flight, all sharing group commits.
+ * A task may be destroyed while suspended, on the draining thread: the
+ * wait it was in is abandoned, and its completion is dropped unseen.
+ */
+namespace async {
+
+template <typename T> class Task;
+
+namespace detail {
+
+// Shared by a suspended Durable, its log callback and the queue, so it
+// outlives the frame; `abandoned` is set when the frame goes away first
+struct Wakeup {
+  coroutine_handle<> caller;
+  exception_ptr error;
+  bool abandoned = false; // only touched on the draining thread
+};
+
+// Hands control straight to whoever awaited the finished task
+struct ResumeContinuation {
+  bool await_ready() noexcept { return false; }
+  template <typename P>
+  coroutine_handle<> await_suspend(coroutine_handle<P> self) noexcept {
+    return self.promise().continuation;
+  }
+  void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+  coroutine_handle<> continuation = noop_coroutine();
+  exception_ptr error;
+
+  suspend_always initial_suspend() noexcept { return {}; }
+  ResumeContinuation final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { error = current_exception(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  optional<T> value;
+
+  Task<T> get_return_object();
+  template <typename U> void return_value(U &&result) {
+    value.emplace(std::forward<U>(result));
+  }
+  T take() {
+    if (error) {
+      rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void take() {
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+};
+
+} // namespace detail
+
+// A task is awaited or driven once; destroying it destroys the frame
+template <typename T = void> class Task {
+public:
+  using promise_type = detail::Promise<T>;
+
+  explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+  Task(Task &&other) noexcept : handle(exchange(other.handle, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (handle) {
+        handle.destroy();
+      }
+      handle = exchange(other.handle, {});
+    }
+    return *this;
+  }
+  ~Task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+    handle.promise().continuation = caller;
+    return handle;
+  }
+  T await_resume() { return handle.promise().take(); }
+
+  // Runs the task up to its first suspension
+  void start() { handle.resume(); }
+  bool done() const { return handle.done(); }
+  T result() { return handle.promise().take(); }
+
+private:
+  coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() {
+  return Task<T>(coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+// Coroutines ready to continue; any thread posts, the owner resumes
+class CompletionQueue {
+private:
+  mutex lock;
+  condition_variable posted;
+  vector<shared_ptr<detail::Wakeup>> ready;
+
+public:
+  void post(shared_ptr<detail::Wakeup> wakeup) {
+    {
+      lock_guard guard(lock);
+      ready.push_back(std::move(wakeup));
+    }
+    posted.notify_one();
+  }
+
+  // Resumes everything posted so far whose task is still alive;
+  // returns how many were taken off the queue
+  size_t poll() {
+    vector<shared_ptr<detail::Wakeup>> batch;
+    {
+      lock_guard guard(lock);
+      batch.swap(ready);
+    }
+    for (const auto &wakeup : batch) {
+      if (!wakeup->abandoned) {
+        wakeup->caller.resume();
+      }
+    }
+    return batch.size();
+  }
+
+  // Blocks until something is posted, then polls
+  size_t wait() {
+    {
+      unique_lock guard(lock);
+      posted.wait(guard, [&] { return !ready.empty(); });
+    }
+    return poll();
+  }
+};
+
+// Suspends until `sequence` is durable in `log`; a null log or sequence
+// 0 (nothing logged) completes at once
+class Durable {
+private:
+  WriteAheadLog *log;
+  uint64_t sequence;
+  CompletionQueue &queue;
+  shared_ptr<detail::Wakeup> wakeup;
+
+public:
+  Durable(WriteAheadLog *log, uint64_t sequence, CompletionQueue &queue)
+      : log(log), sequence(sequence), queue(queue) {}
+  Durable(const Durable &) = delete;
+  Durable &operator=(const Durable &) = delete;
+
+  // Runs when the frame is destroyed, suspended or not
+  ~Durable() {
+    if (wakeup) {
+      wakeup->abandoned = true;
+    }
+  }
+
+  bool await_ready() const noexcept { return log == nullptr || sequence == 0; }
+  void await_suspend(coroutine_handle<> caller) {
+    wakeup = make_shared<detail::Wakeup>();
+    wakeup->caller = caller;
+    log->onDurable(sequence, [wakeup = wakeup, &queue = queue](
+                                 exception_ptr failed) {
+      wakeup->error = failed;
+      queue.post(wakeup);
+    });
+  }
+  void await_resume() {
+    if (wakeup && wakeup->error) {
+      rethrow_exception(wakeup->error);
+    }
+  }
+};
+
+// Drives the tasks to completion on the calling thread, resuming them
+// as their completions arrive
+template <typename T>
+void syncWaitAll(span<Task<T>> tasks, CompletionQueue &queue) {
+  for (auto &task : tasks) {
+    task.start();
+  }
+  for (auto &task : tasks) {
+    while (!task.done()) {
+      queue.wait();
+    }
+  }
+}
+
+template <typename T> T syncWait(Task<T> task, CompletionQueue &queue) {
+  syncWaitAll(span(&task, 1), queue);
+  return task.result();
+}
+
+} // namespace async
+
+#ifdef ENABLE_METRICS
+/**
+ * Opt-in instrumentation, compiled in with -DENABLE_METRICS. Each thread
+ * writes only its own block of counters and latency histograms, so the
+ * hot path does no atomic read-modify-write and shares no cache lines.
+ * collect() merges all blocks when the numbers are read.
+ */
+namespace metrics {
+
+enum class Counter : uint8_t {
+  CreateUser,
+  CreateUsers,
+  RemoveUser,
+  FindById,
+  FindByEmail,
+  GetAdultUsers,
+  AgeRejected,
+  Count
+};
+
+enum class Latency : uint8_t { CreateUser, FindById, GetAdultUsers, Count };
+
+constexpr size_t CounterCount = size_t(Counter::Count);
+constexpr size_t LatencyCount = size_t(Latency::Count);
+
+constexpr const char *OperationNames[] = {"createUser",    "createUsers",
+                                          "removeUser",    "findById",
+                                          "findByEmail",   "getAdultUsers"};
+constexpr const char *LatencyNames[] = {"createUser", "findById",
+                                        "getAdultUsers"};
+
+// Log-linear buckets in the style of HdrHistogram: 8 sub-buckets per
+// power of two keep each bucket within 12.5% of the values it holds
+constexpr int SubBucketBits = 3;
+constexpr size_t BucketCount = 64 << SubBucketBits;
+
+inline size_t bucketOf(uint64_t value) {
+  if (value < (1u << SubBucketBits)) {
+    return value;
+  }
+  int top = 63 - __builtin_clzll(value);
+  uint64_t sub = (value >> (top - SubBucketBits)) & ((1 << SubBucketBits) - 1);
+  return (size_t(top - SubBucketBits + 1) << SubBucketBits) + sub;
+}
+
+// Largest value that lands in `bucket`
+inline uint64_t bucketLimit(size_t bucket) {
+  if (bucket < (1u << SubBucketBits)) {
+    return bucket;
+  }
+  size_t group = bucket >> SubBucketBits;
+  uint64_t sub = bucket & ((1 << SubBucketBits) - 1);
+  uint64_t low = ((1u << SubBucketBits) + sub) << (group - 1);
+  return low + (uint64_t(1) << (group - 1)) - 1;
+}
+
+struct alignas(64) ThreadBlock {
+  array<atomic<uint64_t>, CounterCount> counters{};
+  array<array<atomic<uint64_t>, BucketCount>, LatencyCount> buckets{};
+  array<atomic<uint64_t>, LatencyCount> totalNanos{};
+};
+
+// Only the owning thread writes a block, so a plain load and store
+// is enough; readers still see whole values
+inline void bump(atomic<uint64_t> &cell, uint64_t by = 1) {
+  cell.store(cell.load(memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+/**
+ * Owns every thread block. A thread that exits hands its block back for
+ * reuse; the counts stay in it, so merged totals never go backwards.
+ */
+class Registry {
+private:
+  mutex lock;
+  vector<unique_ptr<ThreadBlock>> blocks;
+  vector<ThreadBlock *> idle;
+
+public:
+  static Registry &instance() {
+    static Registry registry;
+    return registry;
+  }
+
+  ThreadBlock *acquire() {
+    lock_guard guard(lock);
+    if (!idle.empty()) {
+      ThreadBlock *block = idle.back();
+      idle.pop_back();
+      return block;
+    }
+    blocks.push_back(make_unique<ThreadBlock>());
+    return blocks.back().get();
+  }
+
+  void release(ThreadBlock *block) {
+    lock_guard guard(lock);
+    idle.push_back(block);
+  }
+
+  template <typename F> void forEach(F &&fn) {
+    lock_guard guard(lock);
+    for (const auto &block : blocks) {
+      fn(*block);
+    }
+  }
+};
+
+inline ThreadBlock &local() {
+  struct Holder {
+    ThreadBlock *block = Registry::instance().acquire();
+    ~Holder() { Registry::instance().release(block); }
+  };
+  thread_local Holder holder;
+  return *holder.block;
+}
+
+inline void increment(Counter counter) {
+  bump(local().counters[size_t(counter)]);
+}
+
+inline void record(Latency latency, uint64_t nanos) {
+  ThreadBlock &block = local();
+  bump(block.buckets[size_t(latency)][bucketOf(nanos)]);
+  bump(block.totalNanos[size_t(latency)], nanos);
+}
+
+class ScopedTimer {
+private:
+  Latency latency;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+public:
+  explicit ScopedTimer(Latency latency) : latency(latency) {}
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  ~ScopedTimer() {
+    auto elapsed = chrono::steady_clock::now() - start;
+    record(latency,
+           chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+  }
+};
+
+struct LatencySnapshot {
+  array<uint64_t, BucketCount> buckets{};
+  uint64_t count = 0;
+  uint64_t totalNanos = 0;
+
+  double mean() const { return count == 0 ? 0.0 : double(totalNanos) / count; }
+
+  // Upper bound of the bucket holding the q-th quantile, 0 <= q <= 1
+  uint64_t percentile(double q) const {
+    if (count == 0) {
+      return 0;
+    }
+    auto rank = static_cast<uint64_t>(ceil(q * double(count)));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BucketCount; ++bucket) {
+      seen += buckets[bucket];
+      if (seen >= max<uint64_t>(rank, 1)) {
+        return bucketLimit(bucket);
+      }
+    }
+    return bucketLimit(BucketCount - 1);
+  }
+};
+
+/**
+ * Merged view for scraping. Counters and latencies are process-wide;
+ * the gauges are filled in by the service that took the snapshot.
+ */
+struct Snapshot {
+  array<uint64_t, CounterCount> counters{};
+  array<LatencySnapshot, LatencyCount> latencies{};
+  size_t users = 0;
+  size_t stringBytes = 0;
+  size_t tableBytes = 0;
+
+  uint64_t count(Counter counter) const { return counters[size_t(counter)]; }
+  const LatencySnapshot &latency(Latency latency) const {
+    return latencies[size_t(latency)];
+  }
+
+  // Prometheus text exposition format
+  void writePrometheus(ostream &out) const {
+    out << "# TYPE user_service_calls_total counter\n";
+    for (size_t i = 0; i < size(OperationNames); ++i) {
+      out << "user_service_calls_total{op=\"" << OperationNames[i] << "\"} "
+          << counters[i] << '\n';
+    }
+    out << "# TYPE user_service_age_rejections_total counter\n"
+        << "user_service_age_rejections_total "
+        << count(Counter::AgeRejected) << '\n';
+
+    out << "# TYPE user_service_latency_nanoseconds summary\n";
+    for (size_t i = 0; i < LatencyCount; ++i) {
+      const LatencySnapshot &latency = latencies[i];
+      for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        out << "user_service_latency_nanoseconds{op=\"" << LatencyNames[i]
+            << "\",quantile=\"" << q << "\"} " << latency.percentile(q)
+            << '\n';
+      }
+      out << "user_service_latency_nanoseconds_sum{op=\"" << LatencyNames[i]
+          << "\"} " << latency.totalNanos << '\n'
+          << "user_service_latency_nanoseconds_count{op=\"" << LatencyNames[i]
+          << "\"} " << latency.count << '\n';
+    }
+
+    out << "# TYPE user_service_users gauge\n"
+        << "user_service_users " << users << '\n'
+        << "# TYPE user_service_memory_bytes gauge\n"
+        << "user_service_memory_bytes{area=\"strings\"} " << stringBytes
+        << '\n'
+        << "user_service_memory_bytes{area=\"table\"} " << tableBytes << '\n';
+  }
+};
+
+inline Snapshot collect() {
+  Snapshot snapshot;
+  Registry::instance().forEach([&](const ThreadBlock &block) {
+    for (size_t i = 0; i < CounterCount; ++i) {
+      snapshot.counters[i] += block.counters[i].load(memory_order_relaxed);
+    }
+    for (size_t i = 0; i < LatencyCount; ++i) {
+      LatencySnapshot &latency = snapshot.latencies[i];
+      for (size_t bucket = 0; bucket < BucketCount; ++bucket) {
+        uint64_t hits = block.buckets[i][bucket].load(memory_order_relaxed);
+        latency.buckets[bucket] += hits;
+        latency.count += hits;
+      }
+      latency.totalNanos += block.totalNanos[i].load(memory_order_relaxed);
+    }
+  });
+  return snapshot;
+}
+
+} // namespace metrics
+
+#define METRICS_COUNT(counter) metrics::increment(metrics::Counter::counter)
+#define METRICS_TIME(latency)                                                  \
+  metrics::ScopedTimer metricsTimer(metrics::Latency::latency)
+#else
+#define METRICS_COUNT(counter) ((void)0)
+#define METRICS_TIME(latency) ((void)0)
+#endif
+
+// Input row for bulk user creation
+struct UserSpec {
+  string name;
+  string email;
+  int age;
+};
+
+/**
+ * Secondary indexes kept in step by UserService: a hash index on email
+ * (which also enforces uniqueness) and one id bucket per age, so range
+ * queries touch only the matching users.
+ */
+class UserIndexes {
+public:
+  static constexpr int MaxAge = 150;
+
+  struct EmailHash {
+    size_t operator()(const EmailView &email) const {
+      size_t seed = hash<string_view>{}(email.local);
+      seed ^= hash<string_view>{}(email.domain) + 0x9e3779b9 + (seed << 6) +
+              (seed >> 2);
+      return seed ^ size_t(email.hasDomain);
+    }
+  };
+
+private:
+  // Keys view the users' strings in the StringStore. Users release old
+  // strings only after listeners ran, so a key is gone before its bytes.
+  unordered_map<EmailView, int, EmailHash> byEmail;
+  array<vector<int>, MaxAge + 1> byAge;
+  IdSlotMap agePosition; // id -> position inside its age bucket + 1
+
+  void addToAge(int id, int age) {
+    byAge[age].push_back(id);
+    agePosition.set(id, static_cast<uint32_t>(byAge[age].size()));
+  }
+
+  void removeFromAge(int id, int age) {
+    auto &bucket = byAge[age];
+    uint32_t slot = agePosition.get(id);
+    bucket[slot - 1] = bucket.back();
+    agePosition.set(bucket[slot - 1], slot);
+    bucket.pop_back();
+    agePosition.erase(id);
+  }
+
+public:
+  optional<int> findByEmail(const EmailView &email) const {
+    auto it = byEmail.find(email);
+    if (it == byEmail.end()) {
+      return nullopt;
+    }
+    return it->second;
+  }
+
+  bool isEmailTaken(const EmailView &email, int exceptId = 0) const {
+    auto owner = findByEmail(email);
+    return owner && *owner != exceptId;
+  }
+
+  void insert(int id, const EmailView &email, int age) {
+    byEmail.emplace(email, id);
+    addToAge(id, age);
+  }
+
+  void erase(int id, const EmailView &email, int age) {
+    byEmail.erase(email);
+    removeFromAge(id, age);
+  }
+
+  void updateEmail(int id, const EmailView &previous, const EmailView &email) {
+    byEmail.erase(previous);
+    byEmail.emplace(email, id);
+  }
+
+  void updateAge(int id, int previous, int age) {
+    removeFromAge(id, previous);
+    addToAge(id, age);
+  }
+
+  template <typename F>
+  void forEachInAgeRange(int minAge, int maxAge, F &&fn) const {
+    for (int age = max(minAge, 0); age <= min(maxAge, MaxAge); ++age) {
+      for (int id : byAge[age]) {
+        fn(id);
+      }
+    }
+  }
+};
+
+/**
+ * Running age statistics updated on every insert, removal and age change,
+ * so reads are O(1). Min/max are cached and rebuilt from the histogram
+ * only after the current extreme is removed.
+ */
+class AgeAggregates {
+private:
+  array<uint64_t, UserIndexes::MaxAge + 1> histogram{};
+  size_t total = 0;
+  size_t adults = 0;
+  int64_t ageSum = 0;
+  mutable kernels::MinMax range{INT32_MAX, INT32_MIN};
+  mutable bool rangeDirty = false;
+
+public:
+  void add(int age) {
+    ++histogram[age];
+    ++total;
+    adults += age >= 18;
+    ageSum += age;
+    if (!rangeDirty) {
+      range.min = min(range.min, age);
+      range.max = max(range.max, age);
+    }
+  }
+
+  void remove(int age) {
+    --histogram[age];
+    --total;
+    adults -= age >= 18;
+    ageSum -= age;
+    if (age == range.min || age == range.max) {
+      rangeDirty = true;
+    }
+  }
+
+  void change(int previous, int age) {
+    remove(previous);
+    add(age);
+  }
+
+  size_t count() const { return total; }
+  size_t adultCount() const { return adults; }
+  int64_t sum() const { return ageSum; }
+  double average() const { return total == 0 ? 0.0 : double(ageSum) / total; }
+
+  // Returns {INT32_MAX, INT32_MIN} when empty
+  kernels::MinMax minMax() const {
+    if (rangeDirty) {
+      range = {INT32_MAX, INT32_MIN};
+      for (int age = 0; age <= UserIndexes::MaxAge; ++age) {
+        if (histogram[age] != 0) {
+          range.min = min(range.min, age);
+          range.max = age;
+        }
+      }
+      rangeDirty = false;
+    }
+    return range;
+  }
+
+  const array<uint64_t, UserIndexes::MaxAge + 1> &ageHistogram() const {
+    return histogram;
+  }
+};
+
+// Adult list stamped with the write generation it was computed at
+struct AdultSnapshot {
+  uint64_t generation = 0;
+  vector<shared_ptr<User>> users;
+};
+
+// Shared, read-only result of getAdultUsers()
+using AdultList = shared_ptr<const vector<shared_ptr<User>>>;
+
+/**
+ * User service with business logic
+ */
+class UserService : public UserListener {
+private:
+  Repository<User> repository;
+  UserTable table;
+  optional<UserIndexes> indexes;
+  AgeAggregates aggregates;
+  async::CompletionQueue completionQueue; // outlives the log's callbacks
+  shared_ptr<WriteAheadLog> log; // shared with snapshot writers
+  uint64_t loggedThrough = 0; // log sequence already reflected in memory
+  unique_ptr<WorkStealingPool> pool; // null: scans run on the caller
+  uint64_t writeGeneration = 0; // bumped when the set of adults may change
+  shared_ptr<const AdultSnapshot> adultCache;
+
+  // 16K rows is 64 KiB of ages, a cache-friendly slice; a multiple of 64
+  // so chunks of the adult bitmask never share a word
+  static constexpr size_t ScanChunk = 1 << 14;
+
+  // Calls fn(begin, end) over table rows, spread across the pool when
+  // the table spans more than one chunk
+  template <typename F> void scanRows(F &&fn) const {
+    if (pool) {
+      pool->parallelFor(table.size(), ScanChunk, fn);
+    } else if (table.size() != 0) {
+      fn(size_t(0), table.size());
+    }
+  }
+
+  // Collects users of matching rows, keeping table order
+  template <typename Pred>
+  vector<shared_ptr<User>> selectRows(Pred &&pred) const {
+    const auto &ages = table.ageColumn();
+    const auto &ids = table.idColumn();
+    vector<vector<shared_ptr<User>>> parts(
+        (table.size() + ScanChunk - 1) / ScanChunk);
+    scanRows([&](size_t begin, size_t end) {
+      auto &part = parts[begin / ScanChunk];
+      for (size_t row = begin; row < end; ++row) {
+        if (pred(ages[row])) {
+          part.push_back(*repository.findById(ids[row]));
+        }
+      }
+    });
+    vector<shared_ptr<User>> users;
+    for (auto &part : parts) {
+      users.insert(users.end(), make_move_iterator(part.begin()),
+                   make_move_iterator(part.end()));
+    }
+    return users;
+  }
+
+  void requireUniqueEmail(const EmailView &email, int exceptId = 0) const {
+    if (indexes && indexes->isEmailTaken(email, exceptId)) {
+      throw invalid_argument("Email already registered: " + email.str());
+    }
+  }
+
+  void track(const shared_ptr<User> &user) {
+    ++writeGeneration;
+    table.insert(*user);
+    aggregates.add(user->getAge());
+    if (indexes) {
+      indexes->insert(user->getId(), user->getEmail(), user->getAge());
+    }
+    user->setListener(this);
+  }
+
+  void untrack(User &user) {
+    user.setListener(nullptr);
+    if (indexes) {
+      indexes->erase(user.getId(), user.getEmail(), user.getAge());
+    }
+    aggregates.remove(user.getAge());
+    table.erase(user.getId());
+    ++writeGeneration;
+  }
+
+  /**
+   * The id is only known once the user is stored, so creates are logged
+   * after it; when logging throws, the stored users are taken out again
+   * and keep id 0, as if never added. In synchronous mode the last
+   * record is waited for unless `wait` is false. Returns that record's
+   * sequence, 0 without a log.
+   */
+  uint64_t logCreates(span<const shared_ptr<User>> users, bool wait = true) {
+    if (!log) {
+      return 0;
+    }
+    uint64_t sequence = 0;
+    try {
+      for (const auto &user : users) {
+        sequence = log->append({.type = WriteAheadLog::Type::Create,
+                                .id = user->getId(),
+                                .age = user->getAge(),
+                                .createdAt = toEpochNanos(user->getCreatedAt()),
+                                .name = user->getName(),
+                                .email = user->getEmail()});
+      }
+      if (wait && log->synchronous()) {
+        log->waitDurable(sequence);
+      }
+    } catch (...) {
+      for (const auto &user : users) {
+        untrack(*user);
+        repository.remove(user->getId());
+        user->setId(0);
+      }
+      throw;
+    }
+    return sequence;
+  }
+
+  // createUser up to the log; returns the user and its record's sequence
+  pair<shared_ptr<User>, uint64_t> insertUser(string_view name,
+                                              string_view email, int age,
+                                              bool wait) {
+    METRICS_COUNT(CreateUser);
+    METRICS_TIME(CreateUser);
+    validateAge(age);
+    requireUniqueEmail(splitEmail(email));
+    auto user = repository.save(make_shared<User>(0, name, email, age));
+    track(user);
+    uint64_t sequence = logCreates({&user, 1}, wait);
+    return {std::move(user), sequence};
+  }
+
+  // Applies one replayed record; `log` is still unset, so nothing is
+  // logged twice
+  void apply(const WriteAheadLog::Record &entry) {
+    using Type = WriteAheadLog::Type;
+    if (entry.type == Type::Create) {
+      // Checked like a snapshot row: a bad record must not reach the
+      // age buckets or replace a live user it never untracked
+      validateAge(entry.age);
+      if (entry.id < 1) {
+        throw invalid_argument("Log creates an invalid id");
+      }
+      if (repository.findBorrowed(entry.id) != nullptr) {
+        throw invalid_argument("Log creates an id that already exists");
+      }
+      requireUniqueEmail(entry.email);
+      auto user = make_shared<User>(entry.id, entry.name, entry.email,
+                                    entry.age, fromEpochNanos(entry.createdAt));
+      repository.saveAs(entry.id, user);
+      track(user);
+      return;
+    }
+    if (entry.type == Type::Remove) {
+      removeUser(entry.id);
+      return;
+    }
+    User *user = repository.findBorrowed(entry.id);
+    if (user == nullptr) {
+      return;
+    }
+    if (entry.type == Type::SetName) {
+      user->setName(entry.name);
+    } else if (entry.type == Type::SetEmail) {
+      user->setEmail(entry.email);
+    } else {
+      user->setAge(entry.age);
+    }
+  }
+
+  async::Durable durable(uint64_t sequence) {
+    return {log.get(), sequence, completionQueue};
+  }
+
+public:
+  UserService() = default;
+  explicit UserService(bool withIndexes, size_t scanThreads = 0) {
+    if (withIndexes) {
+      indexes.emplace();
+    }
+    if (scanThreads > 0) {
+      pool = make_unique<WorkStealingPool>(scanThreads);
+    }
+  }
+  UserService(const UserService &) = delete;
+  UserService &operator=(const UserService &) = delete;
+
+  ~UserService() {
+    repository.forEach([](User &user) { user.setListener(nullptr); });
+  }
+
+  shared_ptr<User> createUser(string_view name, string_view email, int age) {
+    return insertUser(name, email, age, /* wait = */ true).first;
+  }
+
+  // Stores a user the caller built, giving it the next id
+  shared_ptr<User> addUser(shared_ptr<User> user) {
+    METRICS_COUNT(CreateUser);
+    validateAge(user->getAge());
+    requireUniqueEmail(user->getEmail());
+    user = repository.save(std::move(user));
+    track(user);
+    logCreates({&user, 1});
+    return user;
+  }
+
+  void reserve(size_t n) {
+    repository.reserve(n);
+    table.reserve(n);
+  }
+
+  void shrinkToFit() {
+    repository.shrinkToFit();
+    table.shrinkToFit();
+  }
+
+  // Users of a batch, or of a restore, share blocks of at most this many.
+  // A removed user is destroyed only with its block, once no sibling is
+  // alive: until then it stays allocated and its name and email stay
+  // held in the StringStore. They are not cleared on removal because a
+  // caller may still hold the user and read them. The cap bounds that
+  // retention to one block per survivor.
+  static constexpr size_t BatchBlockUsers = 1024;
+
+  // Validates every spec before inserting anything, then stores all users
+  // in a few block allocations under a contiguous id range
+  vector<shared_ptr<User>> createUsers(span<const UserSpec> specs) {
+    METRICS_COUNT(CreateUsers);
+    unordered_set<string_view> batchEmails;
+    for (const auto &spec : specs) {
+      validateAge(spec.age);
+      requireUniqueEmail(splitEmail(spec.email));
+      if (indexes && !batchEmails.insert(spec.email).second) {
+        throw invalid_argument("Email repeated in batch: " + spec.email);
+      }
+    }
+
+    CoarseClock::Ticks now = CoarseClock::now(); // one read for the batch
+    vector<shared_ptr<User>> users;
+    users.reserve(specs.size());
+    for (size_t first = 0; first < specs.size(); first += BatchBlockUsers) {
+      auto chunk = specs.subspan(first, min(BatchBlockUsers,
+                                            specs.size() - first));
+      auto block = make_shared<vector<User>>();
+      block->reserve(chunk.size());
+      for (const auto &spec : chunk) {
+        block->emplace_back(0, spec.name, spec.email, spec.age, now);
+      }
+      // Aliasing pointers share the block's single control block
+      for (User &user : *block) {
+        users.emplace_back(block, &user);
+      }
+    }
+
+    repository.saveBatch(users);
+    table.reserve(table.size() + users.size());
+    for (const auto &user : users) {
+      track(user);
+    }
+    logCreates(users);
+    return users;
+  }
+
+  /**
+   * Loads a snapshot into an empty service, keeping the stored ids.
+   * Rows are checked first, so a bad file leaves the service untouched.
+   * Columns are read in place from the mapping, but each row still
+   * becomes a User, in blocks of BatchBlockUsers like createUsers, with
+   * its strings interned in the StringStore: users are mutable and
+   * shared out, so they cannot live in read-only file pages.
+   */
+  void restore(const snapshot::Mapped &image) {
+    if (repository.count() != 0) {
+      throw logic_error("Snapshot restore needs an empty UserService");
+    }
+    if (log) {
+      throw logic_error("Restore the snapshot before opening the log");
+    }
+    auto ids = image.ids();
+    auto ages = image.ages();
+    for (size_t row = 0; row < image.size(); ++row) {
+      validateAge(ages[row]);
+      // Throws for a timestamp the clock cannot hold
+      CoarseClock::fromTimePoint(image.createdAt(row));
+      // The bound comes from the header, so a corrupt id cannot size
+      // anything indexed by id
+      if (ids[row] < 1 || ids[row] >= image.nextId()) {
+        throw invalid_argument("Snapshot holds an invalid id");
+      }
+    }
+
+    // Rows are in table order, which swap-removal scrambles; in id order
+    // every insert appends, and repeated ids end up side by side
+    vector<uint32_t> order(image.size());
+    iota(order.begin(), order.end(), 0);
+    if (!is_sorted(ids.begin(), ids.end())) {
+      sort(order.begin(), order.end(),
+           [&](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+    }
+    for (size_t i = 1; i < order.size(); ++i) {
+      if (ids[order[i]] == ids[order[i - 1]]) {
+        throw invalid_argument("Snapshot repeats an id");
+      }
+    }
+    // createUser refuses a taken email, and the index keeps one owner
+    // per email, so a snapshot must not bring in a second one
+    if (indexes) {
+      unordered_set<EmailView, UserIndexes::EmailHash> emails;
+      emails.reserve(image.size());
+      for (size_t row = 0; row < image.size(); ++row) {
+        if (!emails.insert(image.email(row)).second) {
+          throw invalid_argument("Snapshot repeats an email");
+        }
+      }
+    }
+
+    // Every block is built before anything is stored, so a throw here
+    // still leaves the service untouched
+    vector<shared_ptr<vector<User>>> blocks;
+    for (size_t first = 0; first < order.size(); first += BatchBlockUsers) {
+      size_t end = min(order.size(), first + BatchBlockUsers);
+      auto &block = blocks.emplace_back(make_shared<vector<User>>());
+      block->reserve(end - first);
+      for (size_t i = first; i < end; ++i) {
+        uint32_t row = order[i];
+        block->emplace_back(ids[row], image.name(row), image.email(row),
+                            ages[row], image.createdAt(row));
+      }
+    }
+    vector<pair<int, shared_ptr<User>>> users;
+    users.reserve(order.size());
+    for (const auto &block : blocks) {
+      for (User &user : *block) {
+        users.emplace_back(user.getId(), shared_ptr<User>(block, &user));
+      }
+    }
+    repository.reserve(users.size());
+    table.reserve(users.size());
+    repository.saveAllAs(std::move(users));
+    for (const auto &block : blocks) {
+      for (User &user : *block) {
+        track(shared_ptr<User>(block, &user));
+      }
+    }
+    // Ids of users removed before the snapshot stay retired
+    repository.claim(image.nextId() - 1);
+    loggedThrough = image.logSequence();
+  }
+
+  /**
+   * Replays records newer than the restored snapshot from `path`, then
+   * appends every later mutation to it. Without `options.synchronous`,
+   * a change is durable within the latency budget or after flushLog().
+   */
+  void openLog(const string &path, WriteAheadLog::Options options = {}) {
+    if (log) {
+      throw logic_error("Write-ahead log already open");
+    }
+    log = make_shared<WriteAheadLog>(
+        path, options, loggedThrough,
+        [this](const WriteAheadLog::Record &entry) { apply(entry); });
+  }
+
+  void flushLog() {
+    if (log) {
+      log->flush();
+    }
+  }
+
+  /**
+   * Coroutine forms of createUser and flushLog: they finish once the
+   * change is durable, suspending on the group commit instead of
+   * blocking the thread. Suspended calls resume from completions().
+   * Arguments are owned because the task may run after the caller's
+   * strings are gone.
+   */
+  async::Task<shared_ptr<User>> createUserAsync(string name, string email,
+                                                int age) {
+    auto [user, sequence] = insertUser(name, email, age, /* wait = */ false);
+    co_await durable(sequence);
+    co_return user;
+  }
+
+  async::Task<void> flushAsync() {
+    co_await durable(log ? log->requestFlush() : 0);
+  }
+
+  async::CompletionQueue &completions() { return completionQueue; }
+
+  // Copies the columns, then serializes on a background thread; writers
+  // wait only for the copy. Once the snapshot is published, the log
+  // drops the records it covers, so replay needs that snapshot restored.
+  future<void> writeSnapshot(string path) const {
+    uint64_t sequence = log ? log->lastSequence() : loggedThrough;
+    weak_ptr<WriteAheadLog> covered = log;
+    return snapshot::writeAsync(
+        snapshot::capture(table, sequence, repository.upcomingId()),
+        std::move(path),
+        [covered, sequence] {
+          if (auto wal = covered.lock()) {
+            wal->truncateThrough(sequence);
+          }
+        });
+  }
+
+  bool removeUser(int id) {
+    METRICS_COUNT(RemoveUser);
+    User *user = repository.findBorrowed(id);
+    if (user == nullptr) {
+      return false;
+    }
+    if (log) {
+      log->commit({.type = WriteAheadLog::Type::Remove, .id = id});
+    }
+    untrack(*user);
+    return repository.remove(id);
+  }
+
+  // Runs before the table is updated, so the row still holds old values
+  void onUserChanged(const User &user) override {
+    auto row = table.find(user.getId());
+    if (!row) {
+      return;
+    }
+    validateAge(user.getAge());
+    EmailView previous = row->getEmail();
+    EmailView email = user.getEmail();
+    bool emailChanged = email != previous;
+    bool ageChanged = user.getAge() != row->getAge();
+    if (emailChanged) {
+      requireUniqueEmail(email, user.getId());
+    }
+
+    // Logged once validation passed, before anything derived is touched
+    if (log) {
+      using Type = WriteAheadLog::Type;
+      if (user.getName() != row->getName()) {
+        log->commit({.type = Type::SetName,
+                     .id = user.getId(),
+                     .name = user.getName()});
+      }
+      if (emailChanged) {
+        log->commit(
+            {.type = Type::SetEmail, .id = user.getId(), .email = email});
+      }
+      if (ageChanged) {
+        log->commit(
+            {.type = Type::SetAge, .id = user.getId(), .age = user.getAge()});
+      }
+    }
+
+    if (indexes && emailChanged) {
+      indexes->updateEmail(user.getId(), previous, email);
+    }
+    if (indexes && ageChanged) {
+      indexes->updateAge(user.getId(), row->getAge(), user.getAge());
+    }
+    if (ageChanged) {
+      aggregates.change(row->getAge(), user.getAge());
+      ++writeGeneration;
+    }
+    table.onUserChanged(user);
+  }
+
+  // Recomputed only after a create, remove or age change; repeated
+  // calls share one read-only list
+  AdultList getAdultUsers() {
+    METRICS_COUNT(GetAdultUsers);
+    METRICS_TIME(GetAdultUsers);
+    if (!adultCache || adultCache->generation != writeGeneration) {
+      auto fresh = make_shared<AdultSnapshot>();
+      fresh->generation = writeGeneration;
+      fresh->users = indexes ? findByAgeRange(18, UserIndexes::MaxAge)
+                             : selectRows([](int age) { return age >= 18; });
+      adultCache = std::move(fresh);
+    }
+    return AdultList(adultCache, &adultCache->users);
+  }
+
+  uint64_t generation() const { return writeGeneration; }
+
+  // Inclusive range; falls back to a column scan without indexes
+  vector<shared_ptr<User>> findByAgeRange(int minAge, int maxAge) {
+    if (!indexes) {
+      return selectRows(
+          [&](int age) { return age >= minAge && age <= maxAge; });
+    }
+    vector<shared_ptr<User>> users;
+    indexes->forEachInAgeRange(minAge, maxAge, [&](int id) {
+      users.push_back(*repository.findById(id));
+    });
+    return users;
+  }
+
+  optional<shared_ptr<User>> findByEmail(string_view email) {
+    METRICS_COUNT(FindByEmail);
+    EmailView key = splitEmail(email);
+    if (indexes) {
+      if (auto id = indexes->findByEmail(key)) {
+        return repository.findById(*id);
+      }
+      return nullopt;
+    }
+    optional<shared_ptr<User>> found;
+    repository.forEachWhere(
+        [&](const User &user) { return !found && user.getEmail() == key; },
+        [&](const shared_ptr<User> &user) { found = user; });
+    return found;
+  }
+
+  // Zero-copy variant for callers that only need to look at each adult
+  template <typename F> void forEachAdult(F &&fn) const {
+    table.scanAges([](int age) { return age >= 18; }, fn);
+  }
+
+  // Paginated export: pass the last id seen, 0 to start
+  vector<shared_ptr<User>> scan(int afterId, size_t limit) const {
+    return repository.scan(afterId, limit);
+  }
+
+  optional<shared_ptr<User>> findById(int id) const {
+    METRICS_COUNT(FindById);
+    METRICS_TIME(FindById);
+    return repository.findById(id);
+  }
+
+  // Hot-path form of findById: no refcount traffic, and the pointer is
+  // valid until the user is removed
+  User *findBorrowed(int id) const {
+    METRICS_COUNT(FindById);
+    METRICS_TIME(FindById);
+    return repository.findBorrowed(id);
+  }
+
+  // Constant-time reads from the running aggregates
+  size_t countAdults() const { return aggregates.adultCount(); }
+  double averageAge() const { return aggregates.average(); }
+
+  // Returns {INT32_MAX, INT32_MIN} when there are no users
+  kernels::MinMax ageRange() const { return aggregates.minMax(); }
+
+  const array<uint64_t, UserIndexes::MaxAge + 1> &ageHistogram() const {
+    return aggregates.ageHistogram();
+  }
+
+  // Arbitrary thresholds fall back to a vectorized column scan
+  size_t countAtLeast(int minAge) const {
+    const auto &ages = table.ageColumn();
+    atomic<size_t> total{0};
+    scanRows([&](size_t begin, size_t end) {
+      total.fetch_add(kernels::active().countAtLeast(ages.data() + begin,
+                                                     end - begin, minAge),
+                      memory_order_relaxed);
+    });
+    return total.load();
+  }
 
-public:
-  // Constructor with member initializer list
-  User(int id, const string &name, const string &email, int age)
-      : id(id), name(name), email(email), age(age),
-        createdAt(chrono::system_clock::now()) {}
+  // Bit i is set when row i of getTable() holds an adult
+  vector<uint64_t> selectAdults() const {
+    const auto &ages = table.ageColumn();
+    vector<uint64_t> bits((ages.size() + 63) / 64);
+    scanRows([&](size_t begin, size_t end) {
+      kernels::active().maskAtLeast(ages.data() + begin, end - begin, 18,
+                                    bits.data() + begin / 64);
+    });
+    return bits;
+  }
 
-  // Getters
-  int getId() const { return id; }
-  const string &getName() const { return name; }
-  const string &getEmail() const { return email; }
-  int getAge() const { return age; }
+  // Streams every user straight from the columns in large blocks
+  void exportUsers(ostream &out) const {
+    BufferedUserWriter writer(out);
+    for (size_t row = 0; row < table.size(); ++row) {
+      writer.write(table.row(row));
+    }
+  }
 
-  // Setters
-  void setName(const string &newName) { name = newName; }
-  void setEmail(const string &newEmail) { email = newEmail; }
-  void setAge(int newAge) { age = newAge; }
+  const UserTable &getTable() const { return table; }
 
-  // Computed property
-  bool isAdult() const { return age >= 18; }
+#ifdef ENABLE_METRICS
+  // Process-wide counters and latencies plus this service's gauges
+  metrics::Snapshot metricsSnapshot() const {
+    metrics::Snapshot snapshot = metrics::collect();
+    snapshot.users = repository.count();
+    snapshot.stringBytes = StringStore::instance().bytesUsed();
+    snapshot.tableBytes = table.memoryBytes();
+    return snapshot;
+  }
+#endif
 
-  // Friend function for output
-  friend ostream &operator<<(ostream &os, const User &user) {
-    os << "User{id=" << user.id << ", name=\"" << user.name << "\""
-       << ", age=" << user.age << "}";
-    return os;
+  static void validateAge(int age) {
+    if (age < 0 || age > 150) {
+      METRICS_COUNT(AgeRejected);
+      throw invalid_argument("Age must be between 0 and 150");
+    }
   }
 };
 
 /**
- * Generic repository template class
+ * Thread-safe user service for sharing one instance across request
+ * threads. It has no columnar table; scans walk the shards directly.
  */
-template <typename T> class Repository {
+class ConcurrentUserService {
+public:
+  using SharedUser = shared_ptr<const User>;
+  using AdultList = shared_ptr<const vector<SharedUser>>;
+
 private:
-  map<int, shared_ptr<T>> storage;
-  int nextId = 1;
+  struct AdultSnapshot {
+    uint64_t generation = 0;
+    vector<SharedUser> users;
+  };
+
+  ShardedRepository<User> repository;
+  atomic<uint64_t> writeGeneration{0};
+  mutable atomic<shared_ptr<const AdultSnapshot>> adultCache;
+  vector<unique_ptr<WorkStealingPool>> nodePools; // empty: scan inline
+  vector<shared_ptr<numa::Arena>> nodeArenas;        // empty: plain heap
+
+  static constexpr size_t Shards = ShardedRepository<User>::shardCount();
+  // StringStore lanes used when not placed, so writers split its locks
+  static constexpr size_t StringLanes = 8;
+
+  // A placed user's strings go to its node's lane; otherwise lanes are
+  // dealt out by id
+  size_t stringLaneOf(int id) const {
+    return nodeArenas.empty() ? size_t(id) % StringLanes
+                              : repository.nodeOfId(id);
+  }
+
+  // Bumped after the change is visible, so a reader that sees the new
+  // generation also scans the new state
+  void bump() { writeGeneration.fetch_add(1, memory_order_release); }
+
+  // Builds a user in the arena and string lane of its shard's node
+  template <typename... Args>
+  shared_ptr<User> makeUser(int id, Args &&...args) const {
+    StringStore::LaneScope lane(stringLaneOf(id));
+    if (nodeArenas.empty()) {
+      return make_shared<User>(id, std::forward<Args>(args)...);
+    }
+    size_t node = repository.nodeOfId(id);
+    return allocate_shared<User>(numa::ArenaAllocator<User>(nodeArenas[node]),
+                                 id, std::forward<Args>(args)...);
+  }
+
+  // Any edit may move a user across the adult line
+  template <typename Make> bool edit(int id, Make &&make) {
+    StringStore::LaneScope lane(stringLaneOf(id));
+    if (!repository.update(id, make)) {
+      return false;
+    }
+    bump();
+    return true;
+  }
+
+  // Runs fn(shard) for every shard, on the pool of the shard's node, so
+  // reads stay on the local socket; inline when the service is not placed
+  template <typename F> void forEachShard(F &&fn) const {
+    if (nodePools.empty()) {
+      for (size_t shard = 0; shard < Shards; ++shard) {
+        fn(shard);
+      }
+      return;
+    }
+    vector<future<void>> pending;
+    for (size_t shard = 0; shard < Shards; ++shard) {
+      auto task =
+          make_shared<packaged_task<void()>>([&fn, shard] { fn(shard); });
+      pending.push_back(task->get_future());
+      nodePools[repository.nodeOf(shard)]->submit([task] { (*task)(); });
+    }
+    // Every task must finish before its captures go away, even on error
+    for (auto &result : pending) {
+      result.wait();
+    }
+    for (auto &result : pending) {
+      result.get();
+    }
+  }
+
+  // Parts are merged in shard order, as forEachWhere visits
+  template <typename Pred>
+  vector<SharedUser> selectWhere(Pred pred) const {
+    vector<vector<SharedUser>> parts(Shards);
+    forEachShard([&](size_t shard) {
+      repository.forEachWhereIn(shard, pred, [&](const shared_ptr<User> &u) {
+        parts[shard].push_back(u);
+      });
+    });
+    vector<SharedUser> users;
+    for (auto &part : parts) {
+      users.insert(users.end(), make_move_iterator(part.begin()),
+                   make_move_iterator(part.end()));
+    }
+    return users;
+  }
+
+  template <typename Pred> size_t countWhere(Pred pred) const {
+    array<size_t, Shards> counts{};
+    forEachShard([&](size_t shard) {
+      repository.forEachWhereIn(shard, pred,
+                                [&](const shared_ptr<User> &) {
+                                  ++counts[shard];
+                                });
+    });
+    return accumulate(counts.begin(), counts.end(), size_t(0));
+  }
 
 public:
-  // Add item to repository
-  shared_ptr<T> save(shared_ptr<T> item) {
-    storage[nextId++] = item;
-    return item;
+  ConcurrentUserService() = default;
+
+  /**
+   * NUMA-aware layout: shards are spread over the nodes and sized for
+   * `expectedUsers` from their own node. Every node gets a query pool
+   * pinned to its CPUs, plus an arena and a string lane, both touched
+   * from the node, that hold the users of its shards. With a single node
+   * this is the default layout.
+   */
+  explicit ConcurrentUserService(const vector<numa::Node> &topology,
+                                 size_t expectedUsers = 0) {
+    if (topology.size() < 2) {
+      return;
+    }
+    repository.place(topology, expectedUsers);
+    // Rough per-user footprints: the shared block holding a User, and a
+    // short name plus email local part in the string store
+    constexpr size_t UserBytes = sizeof(User) + 32;
+    constexpr size_t StringBytes = 32;
+    size_t perNode = expectedUsers / topology.size() + 1;
+    for (size_t node = 0; node < topology.size(); ++node) {
+      auto arena = make_shared<numa::Arena>();
+      numa::runOn(topology[node], [&] {
+        arena->reserve(perNode * UserBytes);
+        StringStore::instance().reserveLane(node, perNode * StringBytes);
+      });
+      nodeArenas.push_back(std::move(arena));
+      nodePools.push_back(make_unique<WorkStealingPool>(
+          topology[node].cpus.size(), &topology[node]));
+    }
   }
+  ConcurrentUserService(const ConcurrentUserService &) = delete;
+  ConcurrentUserService &operator=(const ConcurrentUserService &) = delete;
 
-  // Find by ID
-  optional<shared_ptr<T>> findById(int id) const {
-    auto it = storage.find(id);
-    if (it != storage.end()) {
-      return it->second;
+  SharedUser createUser(string_view name, string_view email, int age) {
+    UserService::validateAge(age);
+    auto user = repository.create(
+        [&](int id) { return makeUser(id, name, email, age); });
+    bump();
+    return user;
+  }
+
+  bool removeUser(int id) {
+    if (!repository.remove(id)) {
+      return false;
     }
-    return nullopt;
+    bump();
+    return true;
   }
 
-  // Get all items
-  vector<shared_ptr<T>> findAll() const {
-    vector<shared_ptr<T>> result;
-    for (const auto &[id, item] : storage) {
-      result.push_back(item);
+  /**
+   * Users are shared read-only, so readers, including lock-free
+   * findBorrowed ones, never see a write. A change builds an edited copy
+   * and swaps it in under the shard's write lock; holders of the old
+   * pointer keep the old version. Each setter returns false for an
+   * unknown id.
+   */
+  bool setName(int id, string_view name) {
+    return edit(id, [&](const User &user) {
+      return makeUser(user.getId(), name, user.getEmail(), user.getAge(),
+                      user.getCreatedAt());
+    });
+  }
+
+  bool setEmail(int id, string_view email) {
+    return edit(id, [&](const User &user) {
+      return makeUser(user.getId(), user.getName(), splitEmail(email),
+                      user.getAge(), user.getCreatedAt());
+    });
+  }
+
+  bool setAge(int id, int age) {
+    UserService::validateAge(age);
+    return edit(id, [&](const User &user) {
+      return makeUser(user.getId(), user.getName(), user.getEmail(), age,
+                      user.getCreatedAt());
+    });
+  }
+
+  /**
+   * Cached like UserService::getAdultUsers(). The generation is read
+   * before scanning, so a result is never stamped newer than the state
+   * it saw; racing writers only cost a rescan.
+   */
+  AdultList getAdultUsers() const {
+    uint64_t generation = writeGeneration.load(memory_order_acquire);
+    auto cached = adultCache.load(memory_order_acquire);
+    if (!cached || cached->generation != generation) {
+      auto fresh = make_shared<AdultSnapshot>();
+      fresh->generation = generation;
+      fresh->users =
+          selectWhere([](const User &user) { return user.isAdult(); });
+      cached = fresh;
+      // Publish unless a newer result got there first
+      auto current = adultCache.load(memory_order_acquire);
+      while ((!current || current->generation < generation) &&
+             !adultCache.compare_exchange_weak(current, cached,
+                                                memory_order_acq_rel)) {
+      }
     }
-    return result;
+    return AdultList(cached, &cached->users);
   }
 
-  // Remove by ID
-  bool remove(int id) { return storage.erase(id) > 0; }
+  optional<SharedUser> findById(int id) const {
+    if (auto user = repository.findById(id)) {
+      return *user;
+    }
+    return nullopt;
+  }
 
-  // Get count
-  size_t count() const { return storage.size(); }
+  // Same contract as ShardedRepository::scan. Each shard pages through
+  // its own ids on its node, and the pages are merged by id.
+  vector<SharedUser> scan(int afterId, size_t limit) const {
+    auto users = repository.scan(afterId, limit, [&](auto &&visit) {
+      forEachShard(visit);
+    });
+    return {make_move_iterator(users.begin()), make_move_iterator(users.end())};
+  }
+
+  // Read path with no locks and no refcount traffic
+  const User *findBorrowed(int id, const EpochGuard &guard) const {
+    return repository.findBorrowed(id, guard);
+  }
+
+  size_t count() const { return repository.count(); }
+
+  size_t countAdults() const {
+    return countWhere([](const User &user) { return user.isAdult(); });
+  }
 };
 
 /**
- * User service with business logic
+ * C ABI over UserService, declared for C callers in example.h. Exceptions
+ * stop here and become an "Error: ..." line on stderr plus a NULL/false/0
+ * result.
  */
-class UserService {
-private:
-  Repository<User> repository;
+struct UserRepository {
+  UserService service{/* withIndexes = */ false}; // C allows shared emails
+  mutable vector<User *> listing;                 // backs find_all
+};
 
-public:
-  shared_ptr<User> createUser(const string &name, const string &email,
-                              int age) {
-    validateAge(age);
-    auto user = make_shared<User>(0, name, email, age);
-    return repository.save(user);
+namespace capi {
+
+template <typename R, typename F> R guarded(R fallback, F &&body) {
+  try {
+    return body();
+  } catch (const exception &error) {
+    fprintf(stderr, "Error: %s\n", error.what());
+    return fallback;
+  }
+}
+
+// Same contract as user_format: full length back, text plus terminator
+// written only when it fits
+inline size_t copyOut(char *buf, size_t cap, string_view text) {
+  if (text.size() >= cap) {
+    if (cap > 0) {
+      buf[0] = '\0';
+    }
+    return text.size();
+  }
+  memcpy(buf, text.data(), text.size());
+  buf[text.size()] = '\0';
+  return text.size();
+}
+
+// Copies the address straight from the interned parts, with no string
+inline size_t copyOut(char *buf, size_t cap, const EmailView &email) {
+  size_t length = email.size();
+  if (length >= cap) {
+    if (cap > 0) {
+      buf[0] = '\0';
+    }
+    return length;
+  }
+  char *out = buf;
+  memcpy(out, email.local.data(), email.local.size());
+  out += email.local.size();
+  if (email.hasDomain) {
+    *out++ = '@';
+    memcpy(out, email.domain.data(), email.domain.size());
+    out += email.domain.size();
+  }
+  *out = '\0';
+  return length;
+}
+
+// A caller's user becomes the repository's only once it is stored, so
+// a failed add leaves it with the caller
+struct AdoptedDeleter {
+  bool owned = false;
+  void operator()(User *user) const {
+    if (owned) {
+      delete user;
+    }
   }
+};
 
-  vector<shared_ptr<User>> getAdultUsers() {
-    auto users = repository.findAll();
-    vector<shared_ptr<User>> adults;
+} // namespace capi
 
-    copy_if(users.begin(), users.end(), back_inserter(adults),
-            [](const auto &user) { return user->isAdult(); });
+extern "C" {
 
-    return adults;
+User *user_create(const char *name, const char *email, int age) {
+  if (name == nullptr || email == nullptr) {
+    fprintf(stderr, "Error: name and email cannot be NULL\n");
+    return nullptr;
   }
+  return capi::guarded<User *>(nullptr, [&] {
+    UserService::validateAge(age);
+    return new User(0, name, email, age);
+  });
+}
 
-  optional<shared_ptr<User>> findById(int id) {
-    return repository.findById(id);
+// Stored users belong to their repository; only detached ones (id 0)
+// are freed here
+void user_destroy(User *user) {
+  if (user != nullptr && user->getId() == 0) {
+    delete user;
   }
+}
 
-private:
-  void validateAge(int age) {
-    if (age < 0 || age > 150) {
-      throw invalid_argument("Age must be between 0 and 150");
+bool user_is_adult(const User *user) {
+  return user != nullptr && user->isAdult();
+}
+
+int user_get_id(const User *user) {
+  return user != nullptr ? user->getId() : 0;
+}
+
+int user_get_age(const User *user) {
+  return user != nullptr ? user->getAge() : 0;
+}
+
+// A NULL user reads as an empty string
+size_t user_get_name(const User *user, char *buf, size_t cap) {
+  return capi::copyOut(buf, cap, user != nullptr ? user->getName() : "");
+}
+
+size_t user_get_email(const User *user, char *buf, size_t cap) {
+  return capi::copyOut(buf, cap,
+                       user != nullptr ? user->getEmail() : EmailView());
+}
+
+size_t user_format(char *buf, size_t cap, const User *user) {
+  if (user == nullptr) {
+    return capi::copyOut(buf, cap, "");
+  }
+  size_t length = formatUser(buf, cap > 0 ? cap - 1 : 0, *user);
+  if (length < cap) {
+    buf[length] = '\0';
+  } else if (cap > 0) {
+    buf[0] = '\0';
+  }
+  return length;
+}
+
+void user_print(const User *user) {
+  if (user == nullptr) {
+    printf("User is NULL\n");
+    return;
+  }
+  serial::print(cout, *user) << '\n';
+}
+
+void user_clock_hold(void) { CoarseClock::hold(); }
+void user_clock_release(void) { CoarseClock::release(); }
+
+UserRepository *repository_create(void) {
+  return capi::guarded<UserRepository *>(nullptr,
+                                         [] { return new UserRepository(); });
+}
+
+void repository_destroy(UserRepository *repo) { delete repo; }
+
+bool repository_reserve(UserRepository *repo, int capacity) {
+  if (repo == nullptr || capacity < 0) {
+    return false;
+  }
+  return capi::guarded(false, [&] {
+    repo->service.reserve(static_cast<size_t>(capacity));
+    return true;
+  });
+}
+
+void repository_shrink_to_fit(UserRepository *repo) {
+  if (repo == nullptr) {
+    return;
+  }
+  capi::guarded(false, [&] {
+    repo->service.shrinkToFit();
+    repo->listing.clear();
+    repo->listing.shrink_to_fit();
+    return true;
+  });
+}
+
+bool repository_add(UserRepository *repo, User *user) {
+  if (repo == nullptr || user == nullptr) {
+    return false;
+  }
+  return capi::guarded(false, [&] {
+    shared_ptr<User> adopted(user, capi::AdoptedDeleter{});
+    try {
+      get_deleter<capi::AdoptedDeleter>(adopted)->owned = true;
+      repo->service.addUser(adopted);
+      return true;
+    } catch (...) {
+      get_deleter<capi::AdoptedDeleter>(adopted)->owned = false;
+      throw;
     }
+  });
+}
+
+User *user_create_in(UserRepository *repo, const char *name,
+                     const char *email, int age) {
+  if (repo == nullptr || name == nullptr || email == nullptr) {
+    return nullptr;
   }
-};
+  return capi::guarded<User *>(nullptr, [&] {
+    return repo->service.createUser(name, email, age).get();
+  });
+}
 
-// Lambda examples
-auto isAdult = [](const User &user) { return user.getAge() >= 18; };
-auto getAge = [](const User &user) { return user.getAge(); };
+// Stores all `count` users or none; returns how many were stored and
+// fills `out`, when given, with the new users in input order
+int repository_add_many(UserRepository *repo, const UserFields *users,
+                        int count, User **out) {
+  if (repo == nullptr || users == nullptr || count <= 0) {
+    return 0;
+  }
+  return capi::guarded(0, [&] {
+    vector<UserSpec> specs;
+    specs.reserve(count);
+    for (int i = 0; i < count; ++i) {
+      if (users[i].name == nullptr || users[i].email == nullptr) {
+        throw invalid_argument("name and email cannot be NULL");
+      }
+      specs.push_back({users[i].name, users[i].email, users[i].age});
+    }
+    auto created = repo->service.createUsers(specs);
+    for (size_t i = 0; out != nullptr && i < created.size(); ++i) {
+      out[i] = created[i].get();
+    }
+    return static_cast<int>(created.size());
+  });
+}
 
-// Function template
-template <typename T> void printVector(const vector<T> &vec) {
-  cout << "[";
-  for (size_t i = 0; i < vec.size(); ++i) {
-    cout << vec[i];
-    if (i < vec.size() - 1)
-      cout << ", ";
+// Borrowed lookup: the repository keeps the only reference it needs
+User *repository_find_by_id(const UserRepository *repo, int id) {
+  return repo != nullptr ? repo->service.findBorrowed(id) : nullptr;
+}
+
+// out[i] is the user with ids[i], or NULL; returns how many were found
+int repository_find_many(const UserRepository *repo, const int *ids,
+                         int count, User **out) {
+  if (repo == nullptr || ids == nullptr || out == nullptr) {
+    return 0;
+  }
+  int found = 0;
+  for (int i = 0; i < count; ++i) {
+    out[i] = repository_find_by_id(repo, ids[i]);
+    found += out[i] != nullptr;
+  }
+  return found;
+}
+
+// The array is owned by the repository and valid until its next call
+User **repository_find_all(const UserRepository *repo, int *count) {
+  if (repo == nullptr || count == nullptr) {
+    return nullptr;
+  }
+  return capi::guarded<User **>(nullptr, [&] {
+    auto users = repo->service.scan(0, repo->service.getTable().size());
+    repo->listing.clear();
+    for (const auto &user : users) {
+      repo->listing.push_back(user.get());
+    }
+    *count = static_cast<int>(repo->listing.size());
+    return repo->listing.data();
+  });
+}
+
+int repository_scan(const UserRepository *repo, int after_id, User **buf,
+                    int cap) {
+  if (repo == nullptr || buf == nullptr || cap <= 0) {
+    return 0;
+  }
+  return capi::guarded(0, [&] {
+    auto page = repo->service.scan(after_id, static_cast<size_t>(cap));
+    for (size_t i = 0; i < page.size(); ++i) {
+      buf[i] = page[i].get();
+    }
+    return static_cast<int>(page.size());
+  });
+}
+
+bool repository_remove(UserRepository *repo, int id) {
+  return repo != nullptr &&
+         capi::guarded(false, [&] { return repo->service.removeUser(id); });
+}
+
+bool repository_set_age(UserRepository *repo, int id, int age) {
+  User *user = repository_find_by_id(repo, id);
+  if (user == nullptr) {
+    return false;
+  }
+  return capi::guarded(false, [&] {
+    user->setAge(age);
+    return true;
+  });
+}
+
+int repository_count_adults(const UserRepository *repo) {
+  return repo != nullptr ? static_cast<int>(repo->service.countAdults()) : 0;
+}
+
+bool repository_age_range(UserRepository *repo, int *min_age, int *max_age) {
+  if (repo == nullptr || repo->service.getTable().size() == 0) {
+    return false;
+  }
+  kernels::MinMax range = repo->service.ageRange();
+  if (min_age != nullptr) {
+    *min_age = range.min;
+  }
+  if (max_age != nullptr) {
+    *max_age = range.max;
   }
-  cout << "]" << endl;
+  return true;
 }
 
-// Template specialization
-template <> void printVector<string>(const vector<string> &vec) {
-  cout << "[";
-  for (size_t i = 0; i < vec.size(); ++i) {
-    cout << "\"" << vec[i] << "\"";
-    if (i < vec.size() - 1)
-      cout << ", ";
+// Formats straight from the columnar table, one fwrite per 64 KiB
+void repository_write_all(UserRepository *repo, FILE *out) {
+  if (repo == nullptr || out == nullptr) {
+    return;
   }
-  cout << "]" << endl;
+  const UserTable &table = repo->service.getTable();
+  vector<char> buffer(64 * 1024);
+  size_t used = 0;
+  for (size_t row = 0; row < table.size(); ++row) {
+    size_t length = formatUser(buffer.data() + used, buffer.size() - used,
+                               table.row(row));
+    if (used + length + 1 > buffer.size()) {
+      fwrite(buffer.data(), 1, used, out);
+      used = 0;
+      if (length + 1 > buffer.size()) {
+        buffer.resize(length + 1);
+      }
+      length = formatUser(buffer.data(), buffer.size(), table.row(row));
+    }
+    used += length;
+    buffer[used++] = '\n';
+  }
+  fwrite(buffer.data(), 1, used, out);
+}
+
+} // extern "C"
+
+// Lambda examples
+auto isAdult = [](const auto &user) { return user.getAge() >= 18; };
+auto getAge = [](const auto &user) { return user.getAge(); };
+
+// Function template; strings come out quoted via serial::write
+template <typename T> void printVector(const vector<T> &vec) {
+  serial::print(cout, vec) << '\n';
 }
 
 // Generic algorithms demonstration
@@ -165,27 +5618,22 @@ void demonstrateAlgorithms() {
   vector<int> numbers = {5, 2, 8, 1, 9, 3, 7, 4, 6};
 
   // Sort
-  sort(numbers.begin(), numbers.end());
+  parallel::sort(numbers);
 
   // Find
-  auto it = find(numbers.begin(), numbers.end(), 5);
-  if (it != numbers.end()) {
-    cout << "Found 5 at position " << distance(numbers.begin(), it) << endl;
+  size_t position = parallel::find(numbers, 5);
+  if (position != numbers.size()) {
+    cout << "Found 5 at position " << position << '\n';
   }
 
-  // Transform
-  vector<int> doubled(numbers.size());
-  transform(numbers.begin(), numbers.end(), doubled.begin(),
-            [](int n) { return n * 2; });
-
-  // Filter
-  vector<int> evens;
-  copy_if(numbers.begin(), numbers.end(), back_inserter(evens),
-          [](int n) { return n % 2 == 0; });
+  // Filter and transform fused: doubles the evens and sums them in one pass
+  int doubledEvens = parallel::transformReduce(
+      numbers, 0, plus<>(), [](int n) { return n % 2 == 0 ? n * 2 : 0; });
+  cout << "Sum of doubled evens: " << doubledEvens << '\n';
 
   // Accumulate
-  int sum = accumulate(numbers.begin(), numbers.end(), 0);
-  cout << "Sum: " << sum << endl;
+  int sum = parallel::reduce(numbers, 0);
+  cout << "Sum: " << sum << '\n';
 }
 
 // Smart pointers example
@@ -197,51 +5645,371 @@ private:
 public:
   ResourceManager(const string &n)
       : data(make_unique<vector<int>>()), name(make_shared<string>(n)) {
-    cout << "ResourceManager created: " << *name << endl;
+    cout << "ResourceManager created: " << *name << '\n';
   }
 
-  ~ResourceManager() { cout << "ResourceManager destroyed: " << *name << endl; }
+  ~ResourceManager() { cout << "ResourceManager destroyed: " << *name << '\n'; }
 
   void addData(int value) { data->push_back(value); }
 
   size_t getDataSize() const { return data->size(); }
 };
 
-// Main function
-int main() {
+/**
+ * Micro-benchmarks, run as `example --bench [max-users] [repetitions]`.
+ * Sizes grow 10x from 100 up to max-users (default 10^7), and lookups
+ * replay uniform and skewed id streams. Every size is set up and timed
+ * `repetitions` times (default 5). Results are printed as JSON in Google
+ * Benchmark's layout, each repetition followed by the median, min and
+ * max, so the usual comparison tooling can read them.
+ */
+namespace bench {
+
+struct Result {
+  string name;
+  uint64_t iterations;
+  vector<double> nanosPerOp; // one per repetition
+};
+
+// xorshift64*: cheap and identical from run to run
+inline uint64_t nextRandom(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ull;
+}
+
+// Ids in [1, users]. Skewed streams cube a uniform draw, so half of the
+// lookups land on the first eighth of the ids.
+inline vector<int> accessPattern(size_t users, size_t count, bool skewed) {
+  uint64_t state = 0x9E3779B97F4A7C15ull ^ users;
+  vector<int> ids(count);
+  for (auto &id : ids) {
+    double u = double(nextRandom(state) >> 11) * 0x1.0p-53;
+    if (skewed) {
+      u = u * u * u;
+    }
+    id = 1 + static_cast<int>(u * double(users));
+  }
+  return ids;
+}
+
+// Every id in [1, users] once, in random order
+inline vector<int> shuffledIds(size_t users) {
+  vector<int> ids(users);
+  iota(ids.begin(), ids.end(), 1);
+  uint64_t state = 0xD1B54A32D192ED03ull ^ users;
+  for (size_t i = users; i > 1; --i) {
+    swap(ids[i - 1], ids[nextRandom(state) % i]);
+  }
+  return ids;
+}
+
+// Keeps the optimizer from discarding a benchmarked result
+template <typename T> void keep(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+class Suite {
+private:
+  vector<Result> results;
+  unordered_map<string, size_t> resultOf; // name -> index in results
+
+  static void printRow(ostream &out, const Result &result, string_view kind,
+                       size_t repetition, double nanosPerOp) {
+    out << "    {\"name\": \"" << result.name;
+    if (kind != "iteration") {
+      out << '_' << kind;
+    }
+    out << "\", \"run_name\": \"" << result.name << "\", \"run_type\": \""
+        << (kind == "iteration" ? "iteration" : "aggregate")
+        << "\", \"repetitions\": " << result.nanosPerOp.size();
+    if (kind == "iteration") {
+      out << ", \"repetition_index\": " << repetition;
+    } else {
+      out << ", \"aggregate_name\": \"" << kind << '"';
+    }
+    out << ", \"iterations\": " << result.iterations
+        << ", \"real_time\": " << nanosPerOp << ", \"time_unit\": \"ns\"}";
+  }
+
+public:
+  // Times `fn` once and records it as one repetition of `name`, covering
+  // `ops` operations
+  template <typename F> void measure(string name, uint64_t ops, F &&fn) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    chrono::duration<double, nano> elapsed =
+        chrono::steady_clock::now() - start;
+    double perOp = elapsed.count() / double(max<uint64_t>(ops, 1));
+    auto [it, added] = resultOf.try_emplace(name, results.size());
+    if (added) {
+      results.push_back({std::move(name), ops, {}});
+    }
+    results[it->second].nanosPerOp.push_back(perOp);
+  }
+
+  void print(ostream &out, string_view executable) const {
+    out << "{\n  \"context\": {\"executable\": \"" << executable
+        << "\", \"num_cpus\": " << thread::hardware_concurrency()
+        << "},\n  \"benchmarks\": [\n";
+    const char *separator = "";
+    auto row = [&](const Result &result, string_view kind, size_t repetition,
+                   double nanosPerOp) {
+      out << separator;
+      printRow(out, result, kind, repetition, nanosPerOp);
+      separator = ",\n";
+    };
+    for (const Result &result : results) {
+      const vector<double> &samples = result.nanosPerOp;
+      for (size_t i = 0; i < samples.size(); ++i) {
+        row(result, "iteration", i, samples[i]);
+      }
+
+      vector<double> sorted = samples;
+      sort(sorted.begin(), sorted.end());
+      size_t n = sorted.size();
+      double median = n % 2 ? sorted[n / 2]
+                            : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+      row(result, "median", 0, median);
+      row(result, "min", 0, sorted.front());
+      row(result, "max", 0, sorted.back());
+    }
+    out << "\n  ]\n}\n";
+  }
+};
+
+// One repetition at `n` users, each on fresh containers
+inline void runSize(Suite &suite, size_t n) {
+  constexpr size_t Lookups = 1'000'000;
+  const string size = "/" + to_string(n);
+  const uint64_t scans = max<size_t>(1, Lookups / n);
+  {
+    vector<shared_ptr<User>> users;
+    users.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      users.push_back(make_shared<User>(
+          0, "user", "user" + to_string(i) + "@example.com", int(i % 100)));
+    }
+
+    Repository<User> repository;
+    suite.measure("Repository::save" + size, n, [&] {
+      for (const auto &user : users) {
+        repository.save(user);
+      }
+    });
+    for (bool skewed : {false, true}) {
+      auto ids = accessPattern(n, Lookups, skewed);
+      suite.measure(string("Repository::findById/") +
+                        (skewed ? "skewed" : "uniform") + size,
+                    Lookups, [&] {
+                      size_t hits = 0;
+                      for (int id : ids) {
+                        hits += repository.findById(id).has_value();
+                      }
+                      keep(hits);
+                    });
+      suite.measure(string("Repository::findBorrowed/") +
+                        (skewed ? "skewed" : "uniform") + size,
+                    Lookups, [&] {
+                      size_t hits = 0;
+                      for (int id : ids) {
+                        hits += repository.findBorrowed(id) != nullptr;
+                      }
+                      keep(hits);
+                    });
+    }
+    suite.measure("Repository::findAll" + size, scans, [&] {
+      for (uint64_t i = 0; i < scans; ++i) {
+        keep(repository.findAll());
+      }
+    });
+    auto order = shuffledIds(n);
+    suite.measure("Repository::remove" + size, n, [&] {
+      for (int id : order) {
+        repository.remove(id);
+      }
+    });
+  }
+
+  vector<UserSpec> specs;
+  specs.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    specs.push_back(
+        {"user", "user" + to_string(i) + "@example.com", int(i % 100)});
+  }
   UserService service;
+  auto first = service.createUsers(specs).front();
+  specs = {};
+  keep(service.getAdultUsers()); // builds the cache outside the timing
+  suite.measure("UserService::getAdultUsers/cached" + size, scans, [&] {
+    for (uint64_t i = 0; i < scans; ++i) {
+      keep(service.getAdultUsers());
+    }
+  });
+  // Each call follows an age change, which bumps the write generation,
+  // so every one rebuilds the list
+  suite.measure("UserService::getAdultUsers/cold" + size, scans, [&] {
+    for (uint64_t i = 0; i < scans; ++i) {
+      first->setAge(first->getAge() == 20 ? 21 : 20);
+      keep(service.getAdultUsers());
+    }
+  });
+}
+
+inline void run(size_t maxUsers, size_t repetitions, ostream &out,
+                string_view executable) {
+  Suite suite;
+  for (size_t n = 100; n <= maxUsers; n *= 10) {
+    for (size_t repetition = 0; repetition < repetitions; ++repetition) {
+      runSize(suite, n);
+    }
+  }
+  suite.print(out, executable);
+}
+
+} // namespace bench
+
+// Fresh directory under the system temp path; removed with everything
+// in it when the object goes away
+class ScratchDirectory {
+private:
+  filesystem::path path;
+
+public:
+  ScratchDirectory() {
+    string pattern =
+        (filesystem::temp_directory_path() / "users-XXXXXX").string();
+    if (::mkdtemp(pattern.data()) == nullptr) {
+      throw runtime_error("Cannot create scratch directory: " +
+                          string(strerror(errno)));
+    }
+    path = pattern;
+  }
+
+  ScratchDirectory(const ScratchDirectory &) = delete;
+  ScratchDirectory &operator=(const ScratchDirectory &) = delete;
+
+  ~ScratchDirectory() {
+    error_code ignored;
+    filesystem::remove_all(path, ignored);
+  }
+
+  string file(string_view name) const { return (path / name).string(); }
+};
+
+// Main function
+int main(int argc, char *argv[]) {
+  if (argc > 1 && string_view(argv[1]) == "--bench") {
+    size_t maxUsers = 10'000'000;
+    size_t repetitions = 5;
+    auto parse = [](string_view arg, size_t &value) {
+      auto parsed = from_chars(arg.data(), arg.data() + arg.size(), value);
+      return parsed.ec == errc() && parsed.ptr == arg.data() + arg.size() &&
+             value != 0;
+    };
+    if ((argc > 2 && !parse(argv[2], maxUsers)) ||
+        (argc > 3 && !parse(argv[3], repetitions)) || argc > 4) {
+      cerr << "usage: " << argv[0] << " --bench [max-users] [repetitions]\n";
+      return 1;
+    }
+    bench::run(maxUsers, repetitions, cout, argv[0]);
+    return 0;
+  }
+
+  // Holds the snapshot and log below; declared first so it is removed
+  // only after every service writing there is gone
+  ScratchDirectory scratch;
+  UserService service(/* withIndexes = */ true);
 
   // Create users
   auto alice = service.createUser("Alice Johnson", "alice@example.com", 28);
   auto bob = service.createUser("Bob Smith", "bob@example.com", 17);
   auto charlie = service.createUser("Charlie Brown", "charlie@example.com", 45);
 
-  cout << "Created users:" << endl;
-  cout << *alice << endl;
-  cout << *bob << endl;
-  cout << *charlie << endl;
+  // Bulk import
+  vector<UserSpec> imported = {{"Dana White", "dana@example.com", 34},
+                               {"Eve Adams", "eve@example.com", 16}};
+  auto batch = service.createUsers(imported);
+
+  cout << "Created users:\n";
+  cout << *alice << '\n';
+  cout << *bob << '\n';
+  cout << *charlie << '\n';
+  cout << "Imported " << batch.size() << " users\n";
 
   // Get adult users
   auto adults = service.getAdultUsers();
-  cout << "\nAdult users: " << adults.size() << endl;
+  cout << "\nAdult users: " << adults->size() << '\n';
+  cout << "Average age: " << service.averageAge() << '\n';
+
+  if (auto found = service.findByEmail("bob@example.com")) {
+    cout << "Found by email: " << **found << '\n';
+  }
 
   // Lambda usage
-  for (const auto &user : adults) {
-    if (isAdult(*user)) {
-      cout << "  " << user->getName() << " (age " << getAge(*user) << ")"
-           << endl;
+  service.forEachAdult([](const UserTable::Row &user) {
+    if (isAdult(user)) {
+      cout << "  " << user.getName() << " (age " << getAge(user) << ")\n";
     }
-  }
+  });
+
+  // Durability: a background snapshot plus a log of later mutations
+  const string snapshotPath = scratch.file("users.snapshot");
+  const string logPath = scratch.file("users.wal");
+  service.writeSnapshot(snapshotPath).get();
+  service.openLog(logPath);
+  service.createUser("Frank Moore", "frank@example.com", 52);
+  bob->setAge(18);
+  service.flushLog();
+
+  // Pipelined creates: each suspends until its group commit is durable,
+  // so both share one sync
+  vector<async::Task<shared_ptr<User>>> pending;
+  pending.push_back(
+      service.createUserAsync("Grace Hall", "grace@example.com", 39));
+  pending.push_back(
+      service.createUserAsync("Hank Ito", "hank@example.com", 15));
+  async::syncWaitAll(span(pending), service.completions());
+  async::syncWait(service.flushAsync(), service.completions());
+
+  // Recovery maps the snapshot, then replays the log on top of it
+  UserService restored(/* withIndexes = */ true);
+  restored.restore(snapshot::Mapped(snapshotPath));
+  restored.openLog(logPath);
+  cout << "Recovered " << restored.getTable().size() << " users, "
+       << restored.countAdults() << " adults\n";
 
   // STL algorithm examples
-  cout << "\nAlgorithm demonstrations:" << endl;
+  cout << "\nAlgorithm demonstrations:\n";
   demonstrateAlgorithms();
 
+  // Concurrent service shared across threads, laid out per NUMA node
+  ConcurrentUserService shared(numa::topology());
+  vector<thread> workers;
+  for (int t = 0; t < 4; ++t) {
+    workers.emplace_back([&shared, t] {
+      shared.createUser("Worker " + to_string(t), "worker@example.com", 20);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  cout << "\nConcurrent users: " << shared.count() << '\n';
+
+  // The same engine through the C ABI, one call for the whole batch
+  UserRepository *repo = repository_create();
+  UserFields fields[] = {{"Ivy Chen", "ivy@example.com", 31},
+                         {"Jack Lee", "jack@example.com", 12}};
+  repository_add_many(repo, fields, 2, nullptr);
+  cout << "C API adults: " << repository_count_adults(repo) << '\n';
+  repository_destroy(repo);
+
   // Smart pointer example
   {
     ResourceManager manager("TestManager");
     manager.addData(42);
-    cout << "Data size: " << manager.getDataSize() << endl;
+    cout << "Data size: " << manager.getDataSize() << '\n';
   } // manager destroyed here
 
   return 0;
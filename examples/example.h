@@ -0,0 +1,97 @@
+// C API over the C++ UserService in example.cpp
+//
+// example.c is a separate program, not a client of this one: it keeps
+// its own struct layouts and implementation, and the two are never
+// linked together. It includes this header for the entry points it
+// shares, so the compiler checks both sets of definitions against the
+// same prototypes. user_get_*, repository_add_many and
+// repository_find_many exist only in the C++ engine.
+
+#ifndef EXAMPLE_H
+#define EXAMPLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opaque on the C side
+typedef struct User User;
+typedef struct UserRepository UserRepository;
+
+// Input row for repository_add_many
+typedef struct UserFields {
+    const char* name;
+    const char* email;
+    int age;
+} UserFields;
+
+// Errors print an "Error: ..." line on stderr and return NULL, false or 0.
+//
+// Pointers handed out stay valid until their user is removed or the
+// repository destroyed. Ids only grow and are never handed out twice.
+
+// A user from user_create is the caller's until repository_add stores
+// it; user_destroy frees only users that were never stored
+User* user_create(const char* name, const char* email, int age);
+void user_destroy(User* user);
+
+// A NULL user reads as id 0, age 0, not adult and empty strings
+bool user_is_adult(const User* user);
+int user_get_id(const User* user);
+int user_get_age(const User* user);
+
+// Copy the text and a terminator into buf when it fits in cap; always
+// return the full length. A NULL user gives an empty string; that holds
+// for example.c's user_format as well.
+size_t user_get_name(const User* user, char* buf, size_t cap);
+size_t user_get_email(const User* user, char* buf, size_t cap);
+size_t user_format(char* buf, size_t cap, const User* user);
+void user_print(const User* user);
+
+// Between hold and release, users created on this thread share one clock
+// reading; holds nest
+void user_clock_hold(void);
+void user_clock_release(void);
+
+UserRepository* repository_create(void);
+void repository_destroy(UserRepository* repo);
+bool repository_reserve(UserRepository* repo, int capacity);
+void repository_shrink_to_fit(UserRepository* repo);
+bool repository_add(UserRepository* repo, User* user);
+User* user_create_in(UserRepository* repo, const char* name,
+                     const char* email, int age);
+
+// Stores all count users or none; returns how many were stored and fills
+// out, when given, with the new users in input order
+int repository_add_many(UserRepository* repo, const UserFields* users,
+                        int count, User** out);
+
+User* repository_find_by_id(const UserRepository* repo, int id);
+
+// out[i] is the user with ids[i], or NULL; returns how many were found
+int repository_find_many(const UserRepository* repo, const int* ids,
+                         int count, User** out);
+
+// The array belongs to the repository and is valid until its next call
+User** repository_find_all(const UserRepository* repo, int* count);
+
+// Up to cap users with ids above after_id, in id order; returns how many.
+// Users added during a scan get higher ids and show up in later pages.
+int repository_scan(const UserRepository* repo, int after_id, User** buf,
+                    int cap);
+
+bool repository_remove(UserRepository* repo, int id);
+bool repository_set_age(UserRepository* repo, int id, int age);
+int repository_count_adults(const UserRepository* repo);
+bool repository_age_range(UserRepository* repo, int* min_age, int* max_age);
+void repository_write_all(UserRepository* repo, FILE* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EXAMPLE_H